@@ -0,0 +1,381 @@
+#include "logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Benchmarks for the logger. Results are printed to stdout as JSON lines, one
+// object per measurement, so they can be diffed or loaded between releases.
+// The console sink writes to stderr; redirect it to keep the terminal out of
+// the numbers:
+//
+//   ./benchmark > results.jsonl 2>/dev/null
+//   ./benchmark 0.1 > quick.jsonl 2>/dev/null   // Scale iteration counts
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+double scale = 1.0;
+
+std::size_t scaled(std::size_t count) {
+  return std::max<std::size_t>(1, static_cast<std::size_t>(count * scale));
+}
+
+const char *log_path = "logging_benchmark.log";
+
+void remove_logs() {
+  std::remove(log_path);
+  for (int i = 0; i <= 3; ++i) {
+    std::remove((std::string(log_path) + "." + std::to_string(i)).c_str());
+  }
+}
+
+struct SinkConfig {
+  const char *name;
+  std::shared_ptr<logging::Sink> (*make)();
+};
+
+const SinkConfig sinks[] = {
+    {"null", [] { return std::shared_ptr<logging::Sink>(
+                      std::make_shared<logging::NullSink>()); }},
+    {"file", [] { return std::shared_ptr<logging::Sink>(
+                      std::make_shared<logging::FileSink>(log_path, true)); }},
+    {"rotating",
+     [] {
+       return std::shared_ptr<logging::Sink>(
+           std::make_shared<logging::RotatingFileSink>(log_path, 16 << 20, 3));
+     }},
+#if LOGGING_POSIX
+    {"mmap",
+     [] {
+       return std::shared_ptr<logging::Sink>(
+           std::make_shared<logging::MmapFileSink>(log_path));
+     }},
+    {"uring",
+     [] {
+       return std::shared_ptr<logging::Sink>(
+           std::make_shared<logging::UringFileSink>(log_path, true));
+     }},
+#endif
+    {"binary",
+     [] {
+       return std::shared_ptr<logging::Sink>(
+           std::make_shared<logging::BinaryFileSink>(log_path, true));
+     }},
+    {"callback",
+     [] {
+       return std::shared_ptr<logging::Sink>(
+           std::make_shared<logging::CallbackSink>(
+               [](const logging::RecordView &record) {
+                 static volatile std::size_t sink_bytes = 0;
+                 sink_bytes += record.text.size();
+               }));
+     }},
+    {"console", [] { return std::shared_ptr<logging::Sink>(
+                         std::make_shared<logging::ConsoleSink>()); }},
+};
+
+enum class Mode { Sync, Async, Deferred };
+
+const char *mode_name(Mode mode) {
+  switch (mode) {
+  case Mode::Sync:
+    return "sync";
+  case Mode::Async:
+    return "async";
+  case Mode::Deferred:
+    return "deferred";
+  }
+  return "unknown";
+}
+
+void configure(Mode mode, const SinkConfig &sink) {
+  logging::shutdown();
+  logging::set_sinks({sink.make()});
+  logging::set_deferred_formatting(mode == Mode::Deferred);
+  if (mode != Mode::Sync) {
+    logging::enable_async(1 << 16);
+  }
+}
+
+void reset() {
+  logging::shutdown();
+  logging::set_sinks({std::make_shared<logging::NullSink>()});
+  remove_logs();
+}
+
+std::int64_t percentile(const std::vector<std::int64_t> &sorted, double p) {
+  auto index = static_cast<std::size_t>(p * (sorted.size() - 1));
+  return sorted[index];
+}
+
+// Cost of the two clock reads wrapped around every measured call
+std::int64_t clock_overhead() {
+  std::vector<std::int64_t> samples(scaled(100000));
+  for (auto &sample : samples) {
+    auto start = Clock::now();
+    auto end = Clock::now();
+    sample = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+                 .count();
+  }
+  std::sort(samples.begin(), samples.end());
+  return percentile(samples, 0.5);
+}
+
+// Per-call latency seen by one producer thread
+void bench_latency(Mode mode, const SinkConfig &sink) {
+  configure(mode, sink);
+  std::vector<std::int64_t> samples(scaled(200000));
+  for (std::size_t i = 0; i < samples.size(); ++i) {
+    auto start = Clock::now();
+    LOG_INFO("Latency sample ", i, " value ", 3.25, " user ", "alice");
+    auto end = Clock::now();
+    samples[i] =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count();
+    if (mode != Mode::Sync && i % 4096 == 4095) {
+      // Keep the queue from filling so we measure the enqueue, not blocking
+      logging::flush();
+    }
+  }
+  logging::flush();
+  std::sort(samples.begin(), samples.end());
+  double total = 0;
+  for (auto sample : samples) {
+    total += static_cast<double>(sample);
+  }
+  std::printf("{\"benchmark\":\"latency\",\"mode\":\"%s\",\"sink\":\"%s\","
+              "\"threads\":1,\"calls\":%zu,\"mean_ns\":%.1f,\"p50_ns\":%lld,"
+              "\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld}\n",
+              mode_name(mode), sink.name, samples.size(),
+              total / static_cast<double>(samples.size()),
+              static_cast<long long>(percentile(samples, 0.5)),
+              static_cast<long long>(percentile(samples, 0.99)),
+              static_cast<long long>(percentile(samples, 0.999)),
+              static_cast<long long>(samples.back()));
+  reset();
+}
+
+// Records per second from `threads` producers, including the final drain
+void bench_throughput(Mode mode, const SinkConfig &sink, int threads) {
+  configure(mode, sink);
+  std::size_t per_thread = scaled(400000) / static_cast<std::size_t>(threads);
+  std::vector<std::thread> workers;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t, per_thread] {
+      for (std::size_t i = 0; i < per_thread; ++i) {
+        LOG_INFO("Thread ", t, " iteration ", i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  logging::flush();
+  auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  auto records = per_thread * static_cast<std::size_t>(threads);
+  std::printf("{\"benchmark\":\"throughput\",\"mode\":\"%s\",\"sink\":\"%s\","
+              "\"threads\":%d,\"records\":%zu,\"seconds\":%.6f,"
+              "\"records_per_sec\":%.0f}\n",
+              mode_name(mode), sink.name, threads, records, seconds,
+              static_cast<double>(records) / seconds);
+  reset();
+}
+
+// Producer-side cost per call in async mode as threads are added, while the
+// backend keeps writing its own counters. Queues are sized so no producer
+// waits; a cost that climbs with the thread count points at cache lines
+// shared between producers and the backend. Build with
+// -DLOGGING_CACHE_LINE=8 to measure the library without the padding.
+void bench_producers(int threads) {
+  logging::shutdown();
+  logging::set_sinks({std::make_shared<logging::NullSink>()});
+  std::size_t per_thread = std::max<std::size_t>(scaled(1 << 15), 1);
+  logging::enable_async(per_thread + 2);
+  std::vector<std::thread> workers;
+  std::vector<double> ns(static_cast<std::size_t>(threads));
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t, per_thread, &ns] {
+      LOG_INFO("Thread ", t, " started"); // Allocates this thread's queue
+      auto start = Clock::now();
+      for (std::size_t i = 0; i < per_thread; ++i) {
+        LOG_INFO("Thread ", t, " iteration ", i);
+      }
+      ns[static_cast<std::size_t>(t)] =
+          std::chrono::duration<double, std::nano>(Clock::now() - start)
+              .count() /
+          static_cast<double>(per_thread);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  logging::flush();
+  double total = 0;
+  for (auto value : ns) {
+    total += value;
+  }
+  std::printf("{\"benchmark\":\"producers\",\"mode\":\"async\","
+              "\"cache_line\":%zu,\"threads\":%d,\"calls_per_thread\":%zu,"
+              "\"ns_per_call\":%.1f,\"max_thread_ns_per_call\":%.1f}\n",
+              logging::detail::kCacheLine, threads, per_thread, total / threads,
+              *std::max_element(ns.begin(), ns.end()));
+  reset();
+}
+
+// The same access pattern without the logger: each producer bumps its own
+// counter while a backend thread bumps another, with the counters packed
+// next to each other or each on its own cache line
+template <typename Counter> double count_in_parallel(int threads) {
+  std::vector<Counter> counters(static_cast<std::size_t>(threads) + 1);
+  std::size_t increments = scaled(1 << 22);
+  std::atomic<bool> stop{false};
+  std::thread backend([&] {
+    auto &counter = counters.back().value;
+    while (!stop.load(std::memory_order_relaxed)) {
+      counter.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  std::vector<std::thread> workers;
+  auto start = Clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&counters, t, increments] {
+      auto &counter = counters[static_cast<std::size_t>(t)].value;
+      for (std::size_t i = 0; i < increments; ++i) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  auto ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                .count();
+  stop.store(true, std::memory_order_relaxed);
+  backend.join();
+  return ns / static_cast<double>(increments);
+}
+
+struct PackedCounter {
+  std::atomic<std::uint64_t> value{0};
+};
+
+struct alignas(logging::detail::kCacheLine) AlignedCounter {
+  std::atomic<std::uint64_t> value{0};
+};
+
+void bench_counters(int threads) {
+  std::printf("{\"benchmark\":\"counter_layout\",\"threads\":%d,"
+              "\"packed_ns_per_increment\":%.2f,"
+              "\"aligned_ns_per_increment\":%.2f}\n",
+              threads, count_in_parallel<PackedCounter>(threads),
+              count_in_parallel<AlignedCounter>(threads));
+}
+
+// Producer-side cost per line when `lines` lines at a time are written as
+// one logging::Batch, against the same lines logged one by one
+void bench_batch(Mode mode, std::size_t lines) {
+  configure(mode, sinks[0]);
+  std::size_t batches = scaled(200000) / lines;
+  auto start = Clock::now();
+  for (std::size_t i = 0; i < batches; ++i) {
+    logging::Batch batch;
+    for (std::size_t j = 0; j < lines; ++j) {
+      BATCH_INFO(batch, "Summary ", i, " line ", j, " value ", 3.25);
+    }
+    if (mode != Mode::Sync && i % 512 == 511) {
+      batch.commit();
+      logging::flush();
+    }
+  }
+  auto batched = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                     .count();
+  logging::flush();
+  start = Clock::now();
+  for (std::size_t i = 0; i < batches; ++i) {
+    for (std::size_t j = 0; j < lines; ++j) {
+      LOG_INFO("Summary ", i, " line ", j, " value ", 3.25);
+    }
+    if (mode != Mode::Sync && i % 512 == 511) {
+      logging::flush();
+    }
+  }
+  auto single = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                    .count();
+  logging::flush();
+  auto calls = static_cast<double>(batches * lines);
+  std::printf("{\"benchmark\":\"batch\",\"mode\":\"%s\",\"lines\":%zu,"
+              "\"batches\":%zu,\"batched_ns_per_line\":%.1f,"
+              "\"single_ns_per_line\":%.1f}\n",
+              mode_name(mode), lines, batches, batched / calls, single / calls);
+  reset();
+}
+
+// Cost of a call whose level is filtered out
+void bench_disabled() {
+  logging::set_level(logging::Level::INFO);
+  std::size_t calls = scaled(50000000);
+  volatile int value = 42;
+  auto start = Clock::now();
+  for (std::size_t i = 0; i < calls; ++i) {
+    LOG_DEBUG("Disabled ", value, " iteration ", i);
+  }
+  auto ns = std::chrono::duration<double, std::nano>(Clock::now() - start)
+                .count();
+  std::printf("{\"benchmark\":\"disabled\",\"level\":\"DEBUG\","
+              "\"calls\":%zu,\"ns_per_call\":%.3f}\n",
+              calls, ns / static_cast<double>(calls));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    scale = std::atof(argv[1]);
+  }
+  logging::set_use_colours(false);
+  logging::set_include_thread_id(true);
+  reset();
+
+  std::printf("{\"benchmark\":\"clock_overhead\",\"p50_ns\":%lld}\n",
+              static_cast<long long>(clock_overhead()));
+  bench_disabled();
+
+  for (auto mode : {Mode::Sync, Mode::Async, Mode::Deferred}) {
+    for (const auto &sink : sinks) {
+      bench_latency(mode, sink);
+    }
+  }
+
+  for (auto mode : {Mode::Sync, Mode::Async, Mode::Deferred}) {
+    for (int threads = 1; threads <= 64; threads *= 2) {
+      bench_throughput(mode, sinks[0], threads);
+    }
+    for (const auto &sink : sinks) {
+      bench_throughput(mode, sink, 4);
+    }
+  }
+
+  for (int threads : {1, 8, 32, 64}) {
+    bench_producers(threads);
+  }
+  for (int threads : {1, 8, 32, 64}) {
+    bench_counters(threads);
+  }
+
+  for (auto mode : {Mode::Sync, Mode::Async}) {
+    for (std::size_t lines : {4, 16}) {
+      bench_batch(mode, lines);
+    }
+  }
+
+  remove_logs();
+  return 0;
+}
@@ -1,6 +1,10 @@
 #include "logger.hpp"
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
 #include <future>
+#include <queue>
 #include <random>
 #include <thread>
 #include <vector>
@@ -48,9 +52,16 @@ void test1() {
   auto duration =
       std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-  LOG_INFO("Basic test completed. Duration: ", duration.count(), "ms");
-  LOG_INFO("Total logs: ", num_threads * logs_per_thread * 4, " across ",
-           num_threads, " threads");
+  // Arrays other than char buffers are streamed, like any other type
+  int thread_ids[num_threads] = {};
+  LOG_DEBUG("Thread table at ", thread_ids);
+
+  // The summary lines are written together
+  logging::Batch summary;
+  BATCH_INFO(summary, "Basic test completed. Duration: ", duration.count(),
+             "ms");
+  BATCH_INFO(summary, "Total logs: ", num_threads * logs_per_thread * 4,
+             " across ", num_threads, " threads");
 }
 
 // Test 2: Producer consumer test
@@ -165,9 +176,10 @@ void test2() {
     threads[i].join();
   }
 
-  LOG_INFO("Producer-Consumer test completed");
-  LOG_INFO("Total produced: ", items_produced.load(),
-           ", Total consumed: ", items_consumed.load());
+  logging::Batch summary;
+  BATCH_INFO(summary, "Producer-Consumer test completed");
+  BATCH_INFO(summary, "Total produced: ", items_produced.load(),
+             ", Total consumed: ", items_consumed.load());
 }
 
 // Test 3: Parallel task processing test
@@ -236,9 +248,10 @@ void test3() {
              " completed with result: ", result);
   }
 
-  LOG_INFO("All parallel tasks completed");
-  LOG_INFO("Total CPU result: ", total_cpu_result);
-  LOG_INFO("Total I/O results collected: ", io_results.size());
+  logging::Batch summary;
+  BATCH_INFO(summary, "All parallel tasks completed");
+  BATCH_INFO(summary, "Total CPU result: ", total_cpu_result);
+  BATCH_INFO(summary, "Total I/O results collected: ", io_results.size());
 }
 
 // Test 4: Thread pool simulation with error handling test
@@ -349,9 +362,10 @@ void test4() {
     worker.join();
   }
 
-  LOG_INFO("Thread pool simulation completed");
-  LOG_INFO("Final stats: ", completed_jobs.load(), "/", total_jobs,
-           " jobs completed successfully");
+  logging::Batch summary;
+  BATCH_INFO(summary, "Thread pool simulation completed");
+  BATCH_INFO(summary, "Final stats: ", completed_jobs.load(), "/", total_jobs,
+             " jobs completed successfully");
 }
 
 // Test 5: Rapid logging test
@@ -405,10 +419,61 @@ void test5() {
   auto duration =
       std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-  LOG_INFO("Stress test completed");
-  LOG_INFO("Total logs: ", total_logs.load());
-  LOG_INFO("Duration: ", duration.count(), "ms");
-  LOG_INFO("Logs per second: ", (total_logs.load() * 1000) / duration.count());
+  logging::Batch summary;
+  BATCH_INFO(summary, "Stress test completed");
+  BATCH_INFO(summary, "Total logs: ", total_logs.load());
+  BATCH_INFO(summary, "Duration: ", duration.count(), "ms");
+  BATCH_INFO(summary, "Logs per second: ",
+             (total_logs.load() * 1000) / duration.count());
+}
+
+// Test 6: Batches through a small async queue that drops its oldest records.
+// Every line is either written or counted as dropped, batch lines included.
+void test6() {
+  LOG_INFO("=== Batch Overflow Test ===");
+
+  constexpr int num_threads = 4;
+  constexpr int bursts_per_thread = 5000;
+
+  logging::set_overflow_policy(logging::OverflowPolicy::DropOldest);
+  logging::enable_async(4);
+  auto before = logging::stats();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < bursts_per_thread; ++i) {
+        {
+          logging::Batch burst;
+          for (int j = 0; j <= i % 7; ++j) {
+            BATCH_TRACE(burst, "Thread ", t, " burst ", i, " line ", j);
+          }
+        }
+        LOG_TRACE("Thread ", t, " after burst ", i);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  logging::flush();
+  auto after = logging::stats();
+  logging::shutdown();
+  logging::set_overflow_policy(logging::OverflowPolicy::Block);
+
+  std::uint64_t lines = 0;
+  for (int i = 0; i < bursts_per_thread; ++i) {
+    lines += static_cast<std::uint64_t>(i % 7 + 2) * num_threads;
+  }
+  auto trace = static_cast<std::size_t>(logging::Level::TRACE);
+  auto enqueued = after.enqueued[trace] - before.enqueued[trace];
+  auto dropped = after.dropped[trace] - before.dropped[trace];
+  auto written = after.written[trace] - before.written[trace];
+  LOG_INFO("Batch overflow test completed: ", written, " written, ", dropped,
+           " dropped of ", lines);
+  if (enqueued != lines || written + dropped != lines) {
+    throw std::runtime_error("batch lines lost or miscounted");
+  }
 }
 
 int main() {
@@ -426,6 +491,7 @@ int main() {
     test3(); // Test 3: Parallel task processing test
     test4(); // Test 4: Thread pool simulation with error handling test
     test5(); // Test 5: Rapid logging test
+    test6(); // Test 6: Batch overflow test
 
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
@@ -1,14 +1,107 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
-#include <iomanip>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define LOGGING_POSIX 1
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#elif defined(_WIN32)
+extern "C" __declspec(dllimport) unsigned long __stdcall GetCurrentThreadId();
+#endif
+
+// Calls below this level are removed at compile time: 0 = TRACE ... 5 = FATAL,
+// 6 disables logging entirely
+#ifndef LOGGING_ACTIVE_LEVEL
+#define LOGGING_ACTIVE_LEVEL 0
+#endif
+
+// Maximum length of one formatted log line; longer lines are truncated
+#ifndef LOGGING_LINE_CAPACITY
+#define LOGGING_LINE_CAPACITY 4096
+#endif
+
+// Alignment that keeps data written by one thread off the cache lines other
+// threads read. A fixed value rather than
+// std::hardware_destructive_interference_size, which can differ between
+// translation units built with different tuning flags; set it to that
+// value for your target (128 on Apple silicon, for instance).
+#ifndef LOGGING_CACHE_LINE
+#define LOGGING_CACHE_LINE 64
+#endif
+
+// Define to 1 and link with -lz to let RotatingFileSink gzip rotated files
+#ifndef LOGGING_HAS_ZLIB
+#define LOGGING_HAS_ZLIB 0
+#endif
+
+#if LOGGING_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+// UringFileSink writes through io_uring where this is 1 (by default on Linux
+// with the kernel headers); define to 0 to make it use pwrite(2) instead
+#if !defined(LOGGING_HAS_IO_URING) && defined(__linux__) &&                    \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LOGGING_HAS_IO_URING 1
+#endif
+#endif
+#ifndef LOGGING_HAS_IO_URING
+#define LOGGING_HAS_IO_URING 0
+#endif
+
+#if LOGGING_HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
 
 namespace logging {
 
@@ -21,22 +114,325 @@ enum class Level : std::uint8_t {
   FATAL = 5,
 };
 
+// Number of fractional-second digits in the timestamp
+enum class TimestampPrecision : std::uint8_t {
+  Milliseconds = 3,
+  Microseconds = 6,
+  Nanoseconds = 9,
+};
+
+// How the thread ID field is rendered
+enum class ThreadIdFormat : std::uint8_t {
+  Native = 0, // std::thread::id
+  Index = 1,  // Small sequential number assigned by the logger
+  OsTid = 2,  // Operating system thread ID
+};
+
+// Layout of every log line. Json and Logfmt make the timestamp, level,
+// thread ID and location fields of their own.
+enum class OutputFormat : std::uint8_t {
+  Text = 0,   // [ts] [thread] [LEVEL] message key=value (file:line)
+  Json = 1,   // {"ts":...,"level":...,"msg":...,"key":value}
+  Logfmt = 2, // ts=... level=... msg=... key=value
+};
+
+// What a log call does when its thread's async queue is full
+enum class OverflowPolicy : std::uint8_t {
+  Block = 0,      // Wait for the backend to free a slot
+  DropNewest = 1, // Discard the new record
+  DropOldest = 2, // Discard the oldest queued record to make room
+  Grow = 3,       // Chain another heap-allocated segment onto the queue
+};
+
+class Sink;
+
+// What an idle async backend thread does between passes over the queues
+enum class IdleStrategy : std::uint8_t {
+  Spin = 0,  // Poll continuously: lowest latency, keeps a core busy
+  Yield = 1, // Poll, yielding the CPU between passes
+  Sleep = 2, // Spin and yield briefly, then block until a producer wakes it
+};
+
+// Async mode configuration; see enable_async()
+struct AsyncOptions {
+  std::size_t queue_capacity = 8192; // Records per producer thread
+  // CPUs the backend thread(s) may run on (Linux); empty leaves them unpinned
+  std::vector<int> cpus;
+  // One backend thread per NUMA node, pinned to that node's CPUs (of `cpus`,
+  // if given), draining the queues of threads that first logged there
+  bool per_numa_node = false;
+  IdleStrategy idle = IdleStrategy::Sleep;
+  // Longest the Sleep strategy blocks at a time; its waits start at 1ms
+  // and double up to this
+  std::chrono::milliseconds max_sleep{100};
+};
+
+// When buffered sink output is pushed out. A record at or above `level`
+// flushes immediately; otherwise output is flushed every `interval` or once
+// `max_buffered_bytes` are pending, whichever comes first (0 disables).
+// The default flushes every record.
+struct FlushPolicy {
+  Level level = Level::TRACE;
+  std::chrono::milliseconds interval{0};
+  std::size_t max_buffered_bytes = 0;
+};
+
+// Field name for structured logging. Names of printable ASCII without
+// spaces, quotes, backslashes or '=' are written as-is; others are escaped.
+// Declare a key constexpr to have that checked at compile time.
+struct Key {
+  template <std::size_t N>
+  constexpr Key(const char (&text)[N]) : Key(std::string_view(text, N - 1)) {}
+
+  constexpr explicit Key(std::string_view text)
+      : name(text), plain(is_plain(text)) {}
+
+  std::string_view name;
+  bool plain;
+
+private:
+  static constexpr bool is_plain(std::string_view text) {
+    for (char c : text) {
+      if (c <= ' ' || c == '"' || c == '\\' || c == '=' || c == 0x7f) {
+        return false;
+      }
+    }
+    return !text.empty();
+  }
+};
+
+// A structured field, made by kv(). Holds a reference, so it only lives for
+// the log call.
+template <typename T> struct KeyValue {
+  Key key;
+  const T &value;
+};
+
+template <typename T> KeyValue<T> kv(Key key, const T &value) {
+  return {key, value};
+}
+
+// An argument computed only when its line is formatted, made by lazy(). In
+// async mode a deferred record keeps a copy of `fn` and calls it on the
+// backend thread after the call has returned, so its captures must own
+// their data; use lazy_ref() for a function that captures by reference.
+template <typename F> struct Lazy {
+  F fn;
+};
+
+template <typename F> Lazy<std::decay_t<F>> lazy(F &&fn) {
+  return {std::forward<F>(fn)};
+}
+
+// An argument computed only if its call is enabled, made by lazy_ref().
+// `fn` runs in the log call, so it may capture by reference; a deferred
+// record keeps what it returned.
+template <typename F> struct LazyRef {
+  F fn;
+};
+
+template <typename F> LazyRef<std::decay_t<F>> lazy_ref(F &&fn) {
+  return {std::forward<F>(fn)};
+}
+
+// Customisation point for user types, used instead of operator<<:
+//
+//   template <> struct logging::log_format<Order> {
+//     static OrderSummary snapshot(const Order &order); // Optional
+//     static void format(std::ostream &out, const OrderSummary &summary);
+//   };
+//
+// snapshot() runs in the log call and should be cheap; without one the value
+// is copied. format() runs wherever the line is formatted, which in async
+// mode is the backend thread.
+template <typename T> struct log_format {};
+
+namespace detail {
+class LoggerRegistry;
+} // namespace detail
+
+// A named logger with its own level, sinks and line flags, used through the
+// LOGGER_* macros. Obtained from logging::get() and never destroyed, so the
+// reference can be kept in a static. Until it is given sinks of its own, its
+// records go to the default logger's sinks; unset flags follow the global
+// ones.
+class Logger {
+public:
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  const std::string &name() const { return name_; }
+
+  // Starts out at the global level
+  void set_level(Level level);
+  Level get_level() const { return level_.load(std::memory_order_relaxed); }
+
+  void add_sink(std::shared_ptr<Sink> sink);
+  void remove_sink(const std::shared_ptr<Sink> &sink);
+  void set_sinks(std::vector<std::shared_ptr<Sink>> sinks);
+
+  void set_include_location(bool enable) {
+    include_location_.store(enable, std::memory_order_relaxed);
+  }
+  void set_include_thread_id(bool enable) {
+    include_thread_id_.store(enable, std::memory_order_relaxed);
+  }
+
+private:
+  friend class detail::LoggerRegistry;
+
+  static constexpr std::int8_t kUnset = -1;
+
+  Logger(std::string_view name, Level level) : name_(name), level_(level) {}
+
+  const std::string name_;
+  std::atomic<Level> level_;
+  // Guarded by output_mutex()
+  std::vector<std::shared_ptr<Sink>> sinks_;
+  std::atomic<std::int8_t> include_location_{kUnset};
+  std::atomic<std::int8_t> include_thread_id_{kUnset};
+  Logger *next_ = nullptr;
+};
+
 namespace detail {
-// Thread-safe singleton
+constexpr std::size_t kLevelCount = 6;
+constexpr std::size_t kCacheLine = LOGGING_CACHE_LINE;
+
+// Read-mostly settings, published together as one immutable snapshot
+struct Config {
+  Level current_level = Level::INFO;
+  bool include_location = false;
+  bool include_thread_id = true;
+  ThreadIdFormat thread_id_format = ThreadIdFormat::Native;
+  bool use_colours = true;
+  bool deferred_formatting = false;
+  TimestampPrecision timestamp_precision = TimestampPrecision::Milliseconds;
+  OutputFormat output_format = OutputFormat::Text;
+
+  Level flush_level = Level::TRACE;
+  std::int64_t flush_interval_ms = 0;
+  std::size_t flush_max_buffered_bytes = 0;
+  // Duplicate suppression window; 0 disables it
+  std::int64_t duplicate_window_ms = 0;
+  // Capture records below their level for the backtrace ring
+  bool backtrace = false;
+  Level backtrace_trigger = Level::ERROR;
+
+  // Indexed by level
+  std::array<OverflowPolicy, kLevelCount> overflow_policies = {};
+};
+
+// The current settings. A replaced snapshot is freed once no thread holds
+// it; each thread keeps its own reference and only takes a new one when the
+// settings have changed, so reading them neither copies them nor touches
+// the shared count.
 class State {
+  struct Cache {
+    std::uint64_t generation = 0;
+    std::shared_ptr<const Config> config;
+    int depth = 0;
+    bool exited = false;
+
+    ~Cache() {
+      exited = true;
+      config.reset();
+    }
+  };
+
 public:
   static State &instance() {
     static State instance;
     return instance;
   }
 
-  std::atomic<Level> current_level{Level::INFO};
-  std::atomic<bool> include_location{false};
-  std::atomic<bool> include_thread_id{true};
-  std::atomic<bool> use_colours{true};
+  // The current settings for one log call. A call made while another is (a
+  // log call from operator<<) keeps the outer call's snapshot.
+  class Hold {
+  public:
+    Hold() {
+      auto &cache = State::cache();
+      if (cache.exited) {
+        // Thread exit, after the cache was destroyed
+        held_ = instance().load(nullptr);
+        config_ = held_.get();
+        return;
+      }
+      if (cache.depth++ == 0 &&
+          instance().generation_.load(std::memory_order_acquire) !=
+              cache.generation) {
+        cache.config = instance().load(&cache.generation);
+      }
+      config_ = cache.config.get();
+      depth_ = &cache.depth;
+    }
+
+    ~Hold() {
+      if (depth_) {
+        --*depth_;
+      }
+    }
+
+    Hold(const Hold &) = delete;
+    Hold &operator=(const Hold &) = delete;
+
+    const Config &operator*() const { return *config_; }
+    const Config *operator->() const { return config_; }
+
+  private:
+    std::shared_ptr<const Config> held_;
+    const Config *config_ = nullptr;
+    int *depth_ = nullptr;
+  };
+
+  // The global level, also kept outside the snapshot so a level check is a
+  // single load
+  Level level() const { return level_.load(std::memory_order_relaxed); }
+
+  // Publishes the settings with `change` applied
+  template <typename Change> void update(Change &&change) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto config = std::make_shared<Config>(*current_);
+    change(*config);
+    publish(std::move(config));
+  }
+
+  // Guarded by output_mutex(); an empty list means the default console sink
+  std::vector<std::shared_ptr<Sink>> sinks;
+  // Written on every sink write, so kept off the line log calls read.
+  // Bytes written to sinks since the last flush, and records written by
+  // level, both guarded by output_mutex().
+  alignas(kCacheLine) std::size_t pending_bytes = 0;
+  std::uint64_t written[kLevelCount] = {};
 
 private:
-  State() = default;
+  State() { publish(std::make_shared<Config>()); }
+
+  static Cache &cache() {
+    thread_local Cache cache;
+    return cache;
+  }
+
+  std::shared_ptr<const Config> load(std::uint64_t *generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation) {
+      *generation = generation_.load(std::memory_order_relaxed);
+    }
+    return current_;
+  }
+
+  // Guarded by mutex_
+  void publish(std::shared_ptr<const Config> config) {
+    level_.store(config->current_level, std::memory_order_relaxed);
+    current_ = std::move(config);
+    generation_.store(generation_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+  }
+
+  std::mutex mutex_;
+  std::shared_ptr<const Config> current_;
+  // Read by every log call, so kept off the lines written above
+  alignas(kCacheLine) std::atomic<std::uint64_t> generation_{0};
+  std::atomic<Level> level_{Level::INFO};
 };
 
 // ANSI colours
@@ -78,6 +474,111 @@ constexpr std::string_view get_level_name(Level level) {
   }
 }
 
+// Fixed-capacity line buffer. Output past the capacity is dropped, so
+// formatting never touches the heap.
+class LineBuffer {
+public:
+  static constexpr std::size_t kCapacity = LOGGING_LINE_CAPACITY;
+
+  void clear() { size_ = 0; }
+  std::size_t size() const { return size_; }
+  const char *data() const { return data_; }
+  std::string_view view() const { return {data_, size_}; }
+
+  // Only ever shrinks; used to discard a scratch region
+  void truncate(std::size_t size) { size_ = std::min(size, size_); }
+
+  void append(std::string_view value) {
+    std::size_t n = std::min(value.size(), kCapacity - size_);
+    std::memcpy(data_ + size_, value.data(), n);
+    size_ += n;
+  }
+
+  void append(char value) {
+    if (size_ < kCapacity) {
+      data_[size_++] = value;
+    }
+  }
+
+  template <typename T> void append_integer(T value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    append(std::string_view(digits, static_cast<std::size_t>(
+                                        result.ptr - digits)));
+  }
+
+  // Same output as streaming into a default std::ostream (%g, 6 digits)
+  template <typename T> void append_float(T value) {
+    char digits[64];
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    auto result = std::to_chars(digits, digits + sizeof(digits), value,
+                                std::chars_format::general, 6);
+    append(std::string_view(digits, static_cast<std::size_t>(
+                                        result.ptr - digits)));
+#else
+    int n = std::snprintf(digits, sizeof(digits), "%g",
+                          static_cast<double>(value));
+    append(std::string_view(digits, static_cast<std::size_t>(n)));
+#endif
+  }
+
+  void append_pointer(const void *value) {
+    auto address = reinterpret_cast<std::uintptr_t>(value);
+    if (address == 0) {
+      append('0');
+      return;
+    }
+    char digits[2 * sizeof(address)];
+    auto result =
+        std::to_chars(digits, digits + sizeof(digits), address, 16);
+    append("0x");
+    append(std::string_view(digits, static_cast<std::size_t>(
+                                        result.ptr - digits)));
+  }
+
+  // Ends the line with `suffix`, cutting the content short if it won't fit
+  void finish(std::string_view suffix) {
+    size_ = std::min(size_, kCapacity - suffix.size());
+    append(suffix);
+  }
+
+private:
+  std::size_t size_ = 0;
+  char data_[kCapacity];
+};
+
+// Lets operator<< write straight into a LineBuffer
+class LineStreamBuf : public std::streambuf {
+public:
+  explicit LineStreamBuf(LineBuffer &line) : line_(line) {}
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      line_.append(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize count) override {
+    line_.append(std::string_view(data, static_cast<std::size_t>(count)));
+    return count;
+  }
+
+private:
+  LineBuffer &line_;
+};
+
+// An argument kept by a deferred record and formatted when it is decoded;
+// see lazy() and log_format. Owned by the Record.
+class LazyArg {
+public:
+  virtual ~LazyArg() = default;
+  virtual void format(LineBuffer &out) const = 0;
+};
+
+using LazyArgs = std::vector<std::unique_ptr<LazyArg>>;
+
 // Thread-local buffer for efficient formatting
 class ThreadLocalBuffer {
 public:
@@ -86,173 +587,6858 @@ public:
     return buffer;
   }
 
-  std::stringstream &get() {
+  LineBuffer &line() {
+    line_.clear();
+    return line_;
+  }
+
+  // Stream writing into the line buffer, for types without a fast path
+  std::ostream &stream() { return stream_; }
+
+  // Restores default formatting after user manipulators
+  void reset_stream() {
     stream_.clear();
-    stream_.str("");
-    return stream_;
+    stream_.copyfmt(defaults_);
+  }
+
+  // Reusable storage for encoding deferred records
+  std::string &scratch() {
+    scratch_.clear();
+    lazy_args_.clear();
+    return scratch_;
+  }
+
+  // Lazy arguments of the record being encoded
+  LazyArgs &lazy_args() { return lazy_args_; }
+
+private:
+  ThreadLocalBuffer() : streambuf_(line_), stream_(&streambuf_) {}
+
+  LineBuffer line_;
+  LineStreamBuf streambuf_;
+  std::ostream stream_;
+  std::ios defaults_{nullptr};
+  LazyArgs lazy_args_;
+  std::string scratch_;
+};
+
+// Writes `value` as exactly `width` zero-padded decimal digits
+inline void write_digits(char *out, std::uint32_t value, int width) {
+  for (int i = width - 1; i >= 0; --i) {
+    out[i] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  }
+}
+
+// Per-thread cache of the "YYYY-MM-DD HH:MM:SS" prefix: localtime only runs
+// when the second changes, the fraction digits are rewritten on every call.
+class TimestampCache {
+public:
+  static constexpr std::size_t kPrefixSize = 19;
+  static constexpr std::size_t kMaxSize = kPrefixSize + 10;
+
+  static TimestampCache &instance() {
+    thread_local TimestampCache cache;
+    return cache;
+  }
+
+  // Writes the timestamp into `out` (at least kMaxSize bytes), returns length
+  std::size_t format(char *out, std::chrono::system_clock::time_point time,
+                     TimestampPrecision precision) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  time.time_since_epoch())
+                  .count();
+    std::int64_t seconds = ns / 1000000000;
+    std::int64_t fraction = ns % 1000000000;
+    if (fraction < 0) {
+      fraction += 1000000000;
+      --seconds;
+    }
+    if (seconds != cached_second_) {
+      refresh(seconds);
+    }
+    std::memcpy(out, prefix_, kPrefixSize);
+    out[kPrefixSize] = '.';
+    int digits = static_cast<int>(precision);
+    auto scaled = static_cast<std::uint32_t>(fraction);
+    for (int i = digits; i < 9; ++i) {
+      scaled /= 10;
+    }
+    write_digits(out + kPrefixSize + 1, scaled, digits);
+    return kPrefixSize + 1 + static_cast<std::size_t>(digits);
   }
 
 private:
-  std::stringstream stream_;
+  void refresh(std::int64_t seconds) {
+    auto time_t = static_cast<std::time_t>(seconds);
+    std::tm tm{};
+#if defined(_WIN32)
+    localtime_s(&tm, &time_t);
+#else
+    localtime_r(&time_t, &tm);
+#endif
+    write_digits(prefix_, static_cast<std::uint32_t>(tm.tm_year + 1900), 4);
+    prefix_[4] = '-';
+    write_digits(prefix_ + 5, static_cast<std::uint32_t>(tm.tm_mon + 1), 2);
+    prefix_[7] = '-';
+    write_digits(prefix_ + 8, static_cast<std::uint32_t>(tm.tm_mday), 2);
+    prefix_[10] = ' ';
+    write_digits(prefix_ + 11, static_cast<std::uint32_t>(tm.tm_hour), 2);
+    prefix_[13] = ':';
+    write_digits(prefix_ + 14, static_cast<std::uint32_t>(tm.tm_min), 2);
+    prefix_[16] = ':';
+    write_digits(prefix_ + 17, static_cast<std::uint32_t>(tm.tm_sec), 2);
+    cached_second_ = seconds;
+  }
+
+  std::int64_t cached_second_ = INT64_MIN;
+  char prefix_[kPrefixSize] = {};
 };
 
 // Format timestamp
-std::string format_timestamp() {
-  auto now = std::chrono::system_clock::now();
-  auto time_t = std::chrono::system_clock::to_time_t(now);
-  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                now.time_since_epoch()) %
-            1000;
-  std::stringstream ss;
-  ss << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S");
-  ss << '.' << std::setfill('0') << std::setw(3) << ms.count();
-  return ss.str();
+inline std::string format_timestamp(
+    std::chrono::system_clock::time_point now =
+        std::chrono::system_clock::now()) {
+  char buffer[TimestampCache::kMaxSize];
+  auto precision = State::Hold()->timestamp_precision;
+  return std::string(buffer,
+                     TimestampCache::instance().format(buffer, now, precision));
 }
 
-std::string get_thread_id() {
-  std::stringstream ss;
-  ss << std::this_thread::get_id();
-  return ss.str();
+// Fixed-size copy of a thread ID string, cheap to embed in a record
+struct ThreadTag {
+  static constexpr std::size_t kMaxSize = 23;
+
+  std::string_view view() const { return {text, size}; }
+
+  void assign(std::string_view value) {
+    size = static_cast<std::uint8_t>(std::min(value.size(), kMaxSize));
+    std::memcpy(text, value.data(), size);
+  }
+
+  char text[kMaxSize] = {};
+  std::uint8_t size = 0;
+};
+
+inline std::uint64_t os_thread_id() {
+#if defined(__linux__)
+  return static_cast<std::uint64_t>(::syscall(SYS_gettid));
+#elif defined(__APPLE__)
+  std::uint64_t tid = 0;
+  pthread_threadid_np(nullptr, &tid);
+  return tid;
+#elif defined(_WIN32)
+  return GetCurrentThreadId();
+#else
+  return std::hash<std::thread::id>{}(std::this_thread::get_id());
+#endif
 }
 
-// Core logging function
-template <typename... Args>
-void log_impl(Level level, std::string_view file, int line, Args &&...args) {
-  static std::mutex output_mutex;
-  const auto &state = State::instance();
-  // Early exit if log level is disabled
-  if (level < state.current_level.load(std::memory_order_relaxed)) {
-    return;
+// Thread ID strings, computed once per thread
+class ThreadInfo {
+public:
+  static ThreadInfo &instance() {
+    thread_local ThreadInfo info;
+    return info;
+  }
+
+  const ThreadTag &tag(ThreadIdFormat format) const {
+    return tags_[static_cast<std::size_t>(format)];
+  }
+
+private:
+  ThreadInfo() {
+    static std::atomic<std::uint32_t> next_index{1};
+    std::stringstream ss;
+    ss << std::this_thread::get_id();
+    tags_[0].assign(ss.str());
+    tags_[1].assign(
+        std::to_string(next_index.fetch_add(1, std::memory_order_relaxed)));
+    tags_[2].assign(std::to_string(os_thread_id()));
   }
-  // Format message in thread-local buffer first
-  auto &buffer = ThreadLocalBuffer::instance().get();
-  (buffer << ... << args);
-  std::string message = buffer.str();
 
-  // Construct the log line
-  std::stringstream log_line;
+  ThreadTag tags_[3];
+};
+
+inline std::string_view get_thread_id() {
+  auto format = State::Hold()->thread_id_format;
+  return ThreadInfo::instance().tag(format).view();
+}
+
+// String literals and char buffers; other arrays are streamed
+template <typename T> constexpr bool is_char_array() {
+  return std::is_array_v<T> &&
+         std::is_same_v<std::remove_cv_t<std::remove_extent_t<T>>, char>;
+}
+
+// Types the logger formats itself; anything else goes through operator<<
+template <typename T> constexpr bool is_native_arg() {
+  using U = std::decay_t<T>;
+  return std::is_arithmetic_v<U> || is_char_array<T>() ||
+         std::is_convertible_v<const T &, std::string_view> ||
+         (std::is_pointer_v<U> && !std::is_array_v<T> &&
+          !std::is_function_v<std::remove_pointer_t<U>>);
+}
+
+template <typename T> constexpr bool is_char_type() {
+  return std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+         std::is_same_v<T, unsigned char>;
+}
 
-  // Colours
-  bool use_colours = state.use_colours.load(std::memory_order_relaxed);
-  if (use_colours) {
-    log_line << "\033[" << get_colour_code(level) << "m";
+template <typename T> void append_native(LineBuffer &out, const T &value) {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, bool>) {
+    out.append(value ? '1' : '0');
+  } else if constexpr (is_char_type<U>()) {
+    out.append(static_cast<char>(value));
+  } else if constexpr (std::is_integral_v<U>) {
+    using Wide = std::conditional_t<std::is_signed_v<U>, long long,
+                                    unsigned long long>;
+    out.append_integer(static_cast<Wide>(value));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    out.append_float(value);
+  } else if constexpr (is_char_array<T>()) {
+    out.append(std::string_view(value));
+  } else if constexpr (std::is_same_v<U, const char *> ||
+                       std::is_same_v<U, char *>) {
+    out.append(value ? std::string_view(value) : "(null)");
+  } else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+    out.append(std::string_view(value));
+  } else {
+    out.append_pointer(reinterpret_cast<const void *>(value));
   }
+}
+
+template <typename T> struct is_lazy : std::false_type {};
+template <typename F> struct is_lazy<Lazy<F>> : std::true_type {};
+
+template <typename T> struct is_lazy_ref : std::false_type {};
+template <typename F> struct is_lazy_ref<LazyRef<F>> : std::true_type {};
+
+template <typename T, typename = void>
+struct has_log_format : std::false_type {};
+template <typename T>
+struct has_log_format<T, std::void_t<decltype(&log_format<T>::format)>>
+    : std::true_type {};
+
+template <typename T, typename = void> struct has_snapshot : std::false_type {};
+template <typename T>
+struct has_snapshot<T, std::void_t<decltype(log_format<T>::snapshot(
+                           std::declval<const T &>()))>> : std::true_type {};
+
+// Arguments that can be kept unformatted by a deferred record
+template <typename T> constexpr bool is_lazy_arg() {
+  using U = std::decay_t<T>;
+  return is_lazy<U>::value || has_log_format<U>::value;
+}
 
-  // Timestamp
-  log_line << "[" << format_timestamp() << "]";
+// Arguments formatted without operator<<; a lazy_ref() is formatted as what
+// it returns
+template <typename T> constexpr bool is_direct_arg() {
+  return is_native_arg<T>() || is_lazy_arg<T>() ||
+         is_lazy_ref<std::decay_t<T>>::value;
+}
 
-  // Thread ID
-  if (state.include_thread_id.load(std::memory_order_relaxed)) {
-    log_line << " [" << get_thread_id() << "]";
+// What a deferred record keeps of a lazy argument
+template <typename T> auto capture_arg(const T &value) {
+  if constexpr (has_snapshot<T>::value) {
+    return log_format<T>::snapshot(value);
+  } else {
+    return value;
   }
+}
 
-  // Log level
-  log_line << " [" << get_level_name(level) << "] ";
+template <typename T> void append_result(LineBuffer &out, const T &value);
 
-  // Message
-  log_line << message;
+template <typename T, typename Captured>
+void format_captured(LineBuffer &out, const Captured &captured) {
+  if constexpr (is_lazy<T>::value) {
+    append_result(out, captured.fn());
+  } else {
+    LineStreamBuf streambuf(out);
+    std::ostream stream(&streambuf);
+    log_format<T>::format(stream, captured);
+  }
+}
 
-  // Location info
-  if (state.include_location.load(std::memory_order_relaxed)) {
-    log_line << " (" << file << ":" << line << ")";
+// Formats a lazy argument, or what a lazy function returned
+template <typename T> void append_result(LineBuffer &out, const T &value) {
+  if constexpr (is_lazy_ref<T>::value) {
+    append_result(out, value.fn());
+  } else if constexpr (has_snapshot<T>::value) {
+    format_captured<T>(out, log_format<T>::snapshot(value));
+  } else if constexpr (is_lazy_arg<T>()) {
+    format_captured<T>(out, value);
+  } else if constexpr (is_native_arg<T>()) {
+    append_native(out, value);
+  } else {
+    LineStreamBuf streambuf(out);
+    std::ostream stream(&streambuf);
+    stream << value;
   }
+}
+
+// Formats on first use and keeps the text, so sinks that decode a record
+// separately see one evaluation
+template <typename T, typename Captured>
+class CapturedArg final : public LazyArg {
+public:
+  explicit CapturedArg(Captured captured) : captured_(std::move(captured)) {}
 
-  // Reset colour
-  if (use_colours) {
-    log_line << "\033[0m";
+  void format(LineBuffer &out) const override {
+    if (!formatted_) {
+      thread_local LineBuffer text;
+      text.clear();
+      format_captured<T>(text, captured_);
+      text_.assign(text.data(), text.size());
+      formatted_ = true;
+    }
+    out.append(text_);
   }
 
-  log_line << "\n";
+private:
+  Captured captured_;
+  mutable std::string text_;
+  mutable bool formatted_ = false;
+};
 
-  // Thread-safe output to stderr
-  {
-    std::lock_guard<std::mutex> lock(output_mutex);
-    std::cerr << log_line.str();
-    std::cerr.flush();
+// Appends the message to the thread's line buffer. Calls whose arguments
+// are all natively supported or lazy skip iostreams entirely; the rest are
+// streamed as a whole so manipulators keep working.
+template <typename... Args>
+void append_message(ThreadLocalBuffer &buffer, LineBuffer &out,
+                    const Args &...args) {
+  if constexpr ((is_direct_arg<Args>() && ...)) {
+    (append_result(out, args), ...);
+  } else {
+    auto &stream = buffer.stream();
+    auto append = [&](const auto &arg) {
+      if constexpr (is_lazy_arg<decltype(arg)>() ||
+                    is_lazy_ref<std::decay_t<decltype(arg)>>::value) {
+        append_result(out, arg);
+      } else {
+        stream << arg;
+      }
+    };
+    (append(args), ...);
+    buffer.reset_stream();
   }
 }
 
-inline bool is_level_enabled(Level level) {
-  return level >=
-         State::instance().current_level.load(std::memory_order_relaxed);
+// Position of the message body within a formatted line
+struct MessageSpan {
+  std::uint32_t begin = 0;
+  std::uint32_t end = 0;
+};
+
+// Quoting for the Json and Logfmt layouts. Strings are appended raw between
+// begin_string() and end_string(), which escapes them in place if needed, so
+// the common case is a scan with no copy.
+inline bool needs_escape(char c) {
+  return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
 }
 
-} // namespace detail
+inline bool needs_quotes(std::string_view text) {
+  return text.empty() ||
+         std::any_of(text.begin(), text.end(), [](char c) {
+           return needs_escape(c) || c == ' ' || c == '=';
+         });
+}
 
-// Public confuiguration functions
-inline void set_level(Level level) {
-  detail::State::instance().current_level.store(level,
-                                                std::memory_order_relaxed);
+inline void append_escaped(LineBuffer &out, std::string_view text) {
+  for (char c : text) {
+    if (!needs_escape(c)) {
+      out.append(c);
+      continue;
+    }
+    out.append('\\');
+    switch (c) {
+    case '"':
+    case '\\':
+      out.append(c);
+      break;
+    case '\n':
+      out.append('n');
+      break;
+    case '\r':
+      out.append('r');
+      break;
+    case '\t':
+      out.append('t');
+      break;
+    default: {
+      static constexpr char kHex[] = "0123456789abcdef";
+      auto byte = static_cast<unsigned char>(c);
+      out.append("u00");
+      out.append(kHex[byte >> 4]);
+      out.append(kHex[byte & 0xf]);
+    }
+    }
+  }
 }
 
-inline void set_include_location(bool enable) {
-  detail::State::instance().include_location.store(enable,
-                                                   std::memory_order_relaxed);
+inline std::size_t begin_string(LineBuffer &out, OutputFormat format) {
+  if (format == OutputFormat::Json) {
+    out.append('"');
+  }
+  return out.size();
 }
 
-inline void set_include_thread_id(bool enable) {
-  detail::State::instance().include_thread_id.store(enable,
-                                                    std::memory_order_relaxed);
+// Returns the start of the string's content, which moves if Logfmt quotes it
+inline std::size_t end_string(LineBuffer &out, std::size_t begin,
+                              OutputFormat format) {
+  std::string_view text = out.view().substr(begin);
+  bool json = format == OutputFormat::Json;
+  if (json ? std::none_of(text.begin(), text.end(), needs_escape)
+           : !needs_quotes(text)) {
+    if (json) {
+      out.append('"');
+    }
+    return begin;
+  }
+  thread_local std::string copy;
+  copy.assign(text.data(), text.size());
+  out.truncate(begin);
+  if (!json) {
+    out.append('"');
+  }
+  append_escaped(out, copy);
+  out.append('"');
+  return json ? begin : begin + 1;
 }
 
-inline void set_use_colours(bool enable) {
-  detail::State::instance().use_colours.store(enable,
-                                              std::memory_order_relaxed);
+inline void append_string(LineBuffer &out, OutputFormat format,
+                          std::string_view text) {
+  auto begin = begin_string(out, format);
+  out.append(text);
+  end_string(out, begin, format);
 }
 
-inline Level get_level() {
-  return detail::State::instance().current_level.load(
-      std::memory_order_relaxed);
+// Appends ` key=` or `,"key":` ahead of a field's value
+inline void append_key(LineBuffer &out, OutputFormat format, Key key) {
+  if (format == OutputFormat::Json) {
+    out.append(",\"");
+    if (key.plain) {
+      out.append(key.name);
+    } else {
+      append_escaped(out, key.name);
+    }
+    out.append("\":");
+    return;
+  }
+  out.append(' ');
+  if (key.plain) {
+    out.append(key.name);
+  } else {
+    for (char c : key.name) {
+      out.append(needs_escape(c) || c == ' ' || c == '=' ? '_' : c);
+    }
+  }
+  out.append('=');
 }
 
-// Conditional logging macros that avoid argument evaluation when disabled
+// Optional parts of a line; named loggers can override the global flags
+struct LineOptions {
+  bool include_thread_id;
+  bool include_location;
+};
 
-#define LOG_TRACE(...)                                                         \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::TRACE)) {        \
-      ::logging::detail::log_impl(::logging::Level::TRACE, __FILE__, __LINE__, \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
-  } while (0)
+inline LineOptions line_options(const Config &config) {
+  return {config.include_thread_id, config.include_location};
+}
 
-#define LOG_DEBUG(...)                                                         \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::DEBUG)) {        \
-      ::logging::detail::log_impl(::logging::Level::DEBUG, __FILE__, __LINE__, \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
-  } while (0)
+// The Text layout compiled into a list of ops for each level and each
+// combination of line options. The level name and the literal text around
+// it are merged, so a line is a few copies with no per-field branches.
+// Immutable once built.
+class Layout {
+public:
+  enum class Op : std::uint8_t { Literal, Time, Thread, Message, File, Line };
 
-#define LOG_INFO(...)                                                          \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::INFO)) {         \
-      ::logging::detail::log_impl(::logging::Level::INFO, __FILE__, __LINE__,  \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
-  } while (0)
+  struct Step {
+    Op op;
+    std::uint32_t begin = 0; // Literal text in text_
+    std::uint32_t size = 0;
+  };
 
-#define LOG_WARN(...)                                                          \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::WARN)) {         \
-      ::logging::detail::log_impl(::logging::Level::WARN, __FILE__, __LINE__,  \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
-  } while (0)
+  static constexpr std::string_view kDefaultPattern =
+      "[%t] [%i] [%l] %m (%f:%n)";
 
-#define LOG_ERROR(...)                                                         \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::ERROR)) {        \
-      ::logging::detail::log_impl(::logging::Level::ERROR, __FILE__, __LINE__, \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
-  } while (0)
+  // An empty pattern is the default layout, where the thread ID and
+  // location follow the line options; a custom one always has its fields
+  explicit Layout(std::string_view pattern) {
+    for (std::size_t i = 0; i < kLevelCount; ++i) {
+      for (std::size_t options = 0; options < 4; ++options) {
+        auto &steps = steps_[i * 4 + options];
+        auto level = static_cast<Level>(i);
+        if (!pattern.empty()) {
+          compile(pattern, level, steps);
+          continue;
+        }
+        std::string layout = "[%t]";
+        layout += options & 1 ? " [%i]" : "";
+        layout += " [%l] %m";
+        layout += options & 2 ? " (%f:%n)" : "";
+        compile(layout, level, steps);
+      }
+    }
+  }
 
-#define LOG_FATAL(...)                                                         \
-  do {                                                                         \
-    if (::logging::detail::is_level_enabled(::logging::Level::FATAL)) {        \
-      ::logging::detail::log_impl(::logging::Level::FATAL, __FILE__, __LINE__, \
-                                  __VA_ARGS__);                                \
-    }                                                                          \
+  const std::vector<Step> &steps(Level level,
+                                 const LineOptions &options) const {
+    return steps_[static_cast<std::size_t>(level) * 4 +
+                  (options.include_thread_id ? 1 : 0) +
+                  (options.include_location ? 2 : 0)];
+  }
+
+  std::string_view literal(const Step &step) const {
+    return std::string_view(text_).substr(step.begin, step.size);
+  }
+
+private:
+  void literal(std::vector<Step> &steps, std::string_view text) {
+    if (text.empty()) {
+      return;
+    }
+    if (steps.empty() || steps.back().op != Op::Literal ||
+        steps.back().begin + steps.back().size != text_.size()) {
+      steps.push_back({Op::Literal, static_cast<std::uint32_t>(text_.size())});
+    }
+    text_ += text;
+    steps.back().size += static_cast<std::uint32_t>(text.size());
+  }
+
+  void compile(std::string_view pattern, Level level,
+               std::vector<Step> &steps) {
+    int messages = 0;
+    for (std::size_t i = 0; i < pattern.size(); ++i) {
+      if (pattern[i] != '%' || i + 1 == pattern.size()) {
+        literal(steps, pattern.substr(i, 1));
+        continue;
+      }
+      switch (pattern[++i]) {
+      case '%':
+        literal(steps, "%");
+        break;
+      case 'l':
+        literal(steps, get_level_name(level));
+        break;
+      case 't':
+        steps.push_back({Op::Time});
+        break;
+      case 'i':
+        steps.push_back({Op::Thread});
+        break;
+      case 'm':
+        steps.push_back({Op::Message});
+        ++messages;
+        break;
+      case 'f':
+        steps.push_back({Op::File});
+        break;
+      case 'n':
+        steps.push_back({Op::Line});
+        break;
+      default:
+        throw std::invalid_argument("logging: unknown pattern field %" +
+                                    std::string(1, pattern[i]));
+      }
+    }
+    if (messages != 1) {
+      throw std::invalid_argument("logging: pattern needs exactly one %m");
+    }
+  }
+
+  std::array<std::vector<Step>, kLevelCount * 4> steps_;
+  std::string text_;
+};
+
+// The current Layout. A replaced one is freed once no thread holds it; each
+// thread keeps its own reference and only takes a new one when the layout
+// has changed, so formatting a line does not touch the shared count.
+class Layouts {
+  struct Cache {
+    std::uint64_t generation = 0;
+    std::shared_ptr<const Layout> layout;
+    int depth = 0;
+    bool exited = false;
+
+    ~Cache() {
+      exited = true;
+      layout.reset();
+    }
+  };
+
+public:
+  static Layouts &instance() {
+    static Layouts instance;
+    return instance;
+  }
+
+  // The current Layout for one line. A line formatted while another is (a
+  // log call from operator<<) keeps the outer line's layout.
+  class Hold {
+  public:
+    Hold() {
+      auto &cache = Layouts::cache();
+      if (cache.exited) {
+        // Thread exit, after the cache was destroyed
+        held_ = instance().load(nullptr);
+        layout_ = &held_;
+        return;
+      }
+      if (cache.depth++ == 0 &&
+          instance().generation_.load(std::memory_order_acquire) !=
+              cache.generation) {
+        // Under a control block of this thread's own, so the records that
+        // keep a copy do not contend on one shared count
+        auto shared = std::make_shared<std::shared_ptr<const Layout>>(
+            instance().load(&cache.generation));
+        cache.layout = std::shared_ptr<const Layout>(shared, shared->get());
+      }
+      layout_ = &cache.layout;
+      depth_ = &cache.depth;
+    }
+
+    ~Hold() {
+      if (depth_) {
+        --*depth_;
+      }
+    }
+
+    Hold(const Hold &) = delete;
+    Hold &operator=(const Hold &) = delete;
+
+    const Layout &operator*() const { return **layout_; }
+
+    // For a deferred record, which is formatted after the Hold is gone
+    const std::shared_ptr<const Layout> &shared() const { return *layout_; }
+
+  private:
+    std::shared_ptr<const Layout> held_;
+    const std::shared_ptr<const Layout> *layout_ = nullptr;
+    int *depth_ = nullptr;
+  };
+
+  void set(std::string_view pattern) {
+    auto layout = std::make_shared<const Layout>(pattern);
+    std::lock_guard<std::mutex> lock(mutex_);
+    current_ = std::move(layout);
+    generation_.store(generation_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+  }
+
+private:
+  Layouts() { set({}); }
+
+  static Cache &cache() {
+    thread_local Cache cache;
+    return cache;
+  }
+
+  std::shared_ptr<const Layout> load(std::uint64_t *generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation) {
+      *generation = generation_.load(std::memory_order_relaxed);
+    }
+    return current_;
+  }
+
+  std::mutex mutex_;
+  std::shared_ptr<const Layout> current_;
+  alignas(kCacheLine) std::atomic<std::uint64_t> generation_{0};
+};
+
+// How a line is written. Deferred records keep the one in effect when their
+// call was made, so changing the settings does not reformat queued records.
+struct LineFormat {
+  OutputFormat format = OutputFormat::Text;
+  TimestampPrecision precision = TimestampPrecision::Milliseconds;
+  const Layout *layout = nullptr; // For Text; null is the current layout
+};
+
+inline LineFormat line_format(const Config &config) {
+  return {config.output_format, config.timestamp_precision};
+}
+
+// Appends one complete log line; `write_message` fills the body and
+// `write_fields` appends the structured fields, if any. Colours are added by
+// the console sink.
+template <typename WriteMessage, typename WriteFields>
+MessageSpan format_line(LineBuffer &out, const LineFormat &line_format,
+                        const LineOptions &options, Level level,
+                        std::chrono::system_clock::time_point time,
+                        std::string_view thread, std::string_view file,
+                        int line, WriteMessage &&write_message,
+                        WriteFields &&write_fields) {
+  auto format = line_format.format;
+  bool include_thread = options.include_thread_id;
+  bool include_location = options.include_location;
+
+  char timestamp[TimestampCache::kMaxSize];
+  auto precision = line_format.precision;
+  std::string_view ts(
+      timestamp,
+      TimestampCache::instance().format(timestamp, time, precision));
+  MessageSpan span;
+
+  if (format == OutputFormat::Text) {
+    Layouts::Hold hold;
+    const auto &layout = line_format.layout ? *line_format.layout : *hold;
+    for (const auto &step : layout.steps(level, options)) {
+      switch (step.op) {
+      case Layout::Op::Literal:
+        out.append(layout.literal(step));
+        break;
+      case Layout::Op::Time:
+        out.append(ts);
+        break;
+      case Layout::Op::Thread:
+        out.append(thread);
+        break;
+      case Layout::Op::Message:
+        span.begin = static_cast<std::uint32_t>(out.size());
+        write_message();
+        write_fields();
+        span.end = static_cast<std::uint32_t>(out.size());
+        break;
+      case Layout::Op::File:
+        out.append(file);
+        break;
+      case Layout::Op::Line:
+        out.append_integer(line);
+        break;
+      }
+    }
+    out.finish("\n");
+    span.end = std::min(span.end, static_cast<std::uint32_t>(out.size() - 1));
+    return span;
+  }
+
+  // ISO 8601 date and time separator
+  timestamp[10] = 'T';
+  bool json = format == OutputFormat::Json;
+  out.append(json ? "{\"ts\":\"" : "ts=");
+  out.append(ts);
+  out.append(json ? "\",\"level\":\"" : " level=");
+  out.append(get_level_name(level));
+  if (json) {
+    out.append('"');
+  }
+  if (include_thread) {
+    out.append(json ? ",\"thread\":" : " thread=");
+    append_string(out, format, thread);
+  }
+
+  out.append(json ? ",\"msg\":" : " msg=");
+  auto begin = begin_string(out, format);
+  write_message();
+  auto content = end_string(out, begin, format);
+  bool quoted = json || content != begin;
+  span.begin = static_cast<std::uint32_t>(content);
+  span.end = static_cast<std::uint32_t>(out.size() - (quoted ? 1 : 0));
+  write_fields();
+
+  if (include_location) {
+    out.append(json ? ",\"file\":" : " file=");
+    append_string(out, format, file);
+    out.append(json ? ",\"line\":" : " line=");
+    out.append_integer(line);
+  }
+  out.finish(json ? "}\n" : "\n");
+  span.end = std::min(span.end, static_cast<std::uint32_t>(out.size() - 1));
+  return span;
+}
+
+template <typename WriteMessage, typename WriteFields>
+MessageSpan format_line(LineBuffer &out, Level level,
+                        std::chrono::system_clock::time_point time,
+                        std::string_view thread, std::string_view file,
+                        int line, WriteMessage &&write_message,
+                        WriteFields &&write_fields) {
+  State::Hold config;
+  return format_line(out, line_format(*config), line_options(*config), level,
+                     time, thread, file, line, write_message, write_fields);
+}
+
+template <typename WriteMessage>
+MessageSpan format_line(LineBuffer &out, Level level,
+                        std::chrono::system_clock::time_point time,
+                        std::string_view thread, std::string_view file,
+                        int line, WriteMessage &&write_message) {
+  State::Hold config;
+  return format_line(out, line_format(*config), line_options(*config), level,
+                     time, thread, file, line, write_message, [] {});
+}
+
+// Deferred records carry their arguments in a compact binary form: a one-byte
+// tag followed by the raw value, or a length-prefixed copy for strings.
+// Calls with types the logger can't encode are stringified on the caller's
+// thread as a single string. Structured fields follow the message arguments,
+// each a Key (encoded like a string) and then its value.
+enum class ArgType : std::uint8_t {
+  Bool,
+  Char,
+  Int,
+  UInt,
+  Double,
+  String,
+  Pointer,
+  Key,
+  Lazy, // LazyArg *, only ever in memory
+};
+
+template <typename T> void put_raw(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> T get_raw(const char *&data) {
+  T value;
+  std::memcpy(&value, data, sizeof(value));
+  data += sizeof(value);
+  return value;
+}
+
+inline void put_string(std::string &out, std::string_view value,
+                       ArgType type = ArgType::String) {
+  out += static_cast<char>(type);
+  put_raw(out, static_cast<std::uint32_t>(value.size()));
+  out.append(value.data(), value.size());
+}
+
+template <typename T> void encode_arg(std::string &out, const T &value) {
+  using U = std::decay_t<T>;
+  if constexpr (is_lazy_ref<U>::value) {
+    encode_arg(out, value.fn());
+  } else if constexpr (is_lazy_arg<T>()) {
+    using Captured = decltype(capture_arg(value));
+    auto &lazy_args = ThreadLocalBuffer::instance().lazy_args();
+    lazy_args.push_back(
+        std::make_unique<CapturedArg<U, Captured>>(capture_arg(value)));
+    out += static_cast<char>(ArgType::Lazy);
+    put_raw(out, static_cast<const LazyArg *>(lazy_args.back().get()));
+  } else if constexpr (std::is_same_v<U, bool>) {
+    out += static_cast<char>(ArgType::Bool);
+    out += static_cast<char>(value);
+  } else if constexpr (is_char_type<U>()) {
+    out += static_cast<char>(ArgType::Char);
+    out += static_cast<char>(value);
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    out += static_cast<char>(ArgType::Int);
+    put_raw(out, static_cast<std::int64_t>(value));
+  } else if constexpr (std::is_integral_v<U>) {
+    out += static_cast<char>(ArgType::UInt);
+    put_raw(out, static_cast<std::uint64_t>(value));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    out += static_cast<char>(ArgType::Double);
+    put_raw(out, static_cast<double>(value));
+  } else if constexpr (is_char_array<T>()) {
+    put_string(out, std::string_view(value));
+  } else if constexpr (std::is_same_v<U, const char *> ||
+                       std::is_same_v<U, char *>) {
+    put_string(out, value ? std::string_view(value) : "(null)");
+  } else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+    put_string(out, std::string_view(value));
+  } else if constexpr (is_native_arg<T>()) {
+    out += static_cast<char>(ArgType::Pointer);
+    put_raw(out, reinterpret_cast<const void *>(value));
+  } else {
+    auto &buffer = ThreadLocalBuffer::instance();
+    auto &line = buffer.line();
+    buffer.stream() << value;
+    buffer.reset_stream();
+    put_string(out, line.view());
+  }
+}
+
+template <typename... Args>
+void encode_args(std::string &out, const Args &...args) {
+  if constexpr ((is_direct_arg<Args>() && ...)) {
+    (encode_arg(out, args), ...);
+  } else {
+    auto &buffer = ThreadLocalBuffer::instance();
+    auto &line = buffer.line();
+    append_message(buffer, line, args...);
+    put_string(out, line.view());
+  }
+}
+
+// Formats one encoded argument exactly as the original value would have been
+inline void decode_arg(const char *&pos, LineBuffer &out) {
+  auto type = static_cast<ArgType>(*pos++);
+  switch (type) {
+  case ArgType::Bool:
+    out.append(*pos++ ? '1' : '0');
+    break;
+  case ArgType::Char:
+    out.append(*pos++);
+    break;
+  case ArgType::Int:
+    out.append_integer(get_raw<std::int64_t>(pos));
+    break;
+  case ArgType::UInt:
+    out.append_integer(get_raw<std::uint64_t>(pos));
+    break;
+  case ArgType::Double:
+    out.append_float(get_raw<double>(pos));
+    break;
+  case ArgType::String:
+  case ArgType::Key: {
+    auto size = get_raw<std::uint32_t>(pos);
+    out.append(std::string_view(pos, size));
+    pos += size;
+    break;
+  }
+  case ArgType::Pointer:
+    out.append_pointer(get_raw<const void *>(pos));
+    break;
+  case ArgType::Lazy:
+    get_raw<const LazyArg *>(pos)->format(out);
+    break;
+  }
+}
+
+// Formats the message arguments, stopping at the structured fields
+inline void decode_args(std::string_view data, LineBuffer &out) {
+  const char *pos = data.data();
+  const char *end = pos + data.size();
+  while (pos < end && static_cast<ArgType>(*pos) != ArgType::Key) {
+    decode_arg(pos, out);
+  }
+}
+
+// Field values. Strings are quoted and escaped as the format needs; Json
+// has no representation for non-finite numbers, so they become null.
+inline void append_value(LineBuffer &out, OutputFormat, bool value) {
+  out.append(value ? std::string_view("true") : std::string_view("false"));
+}
+
+inline void append_value(LineBuffer &out, OutputFormat, long long value) {
+  out.append_integer(value);
+}
+
+inline void append_value(LineBuffer &out, OutputFormat,
+                         unsigned long long value) {
+  out.append_integer(value);
+}
+
+inline void append_value(LineBuffer &out, OutputFormat format, double value) {
+  if (format == OutputFormat::Json && !std::isfinite(value)) {
+    out.append("null");
+  } else {
+    out.append_float(value);
+  }
+}
+
+inline void append_value(LineBuffer &out, OutputFormat format,
+                         const void *value) {
+  auto begin = begin_string(out, format);
+  out.append_pointer(value);
+  end_string(out, begin, format);
+}
+
+inline void append_value(LineBuffer &out, OutputFormat format,
+                         std::string_view value) {
+  append_string(out, format, value);
+}
+
+// Typed counterpart of encode_arg; only unsupported types are streamed
+template <typename T>
+void append_field(ThreadLocalBuffer &buffer, LineBuffer &out,
+                  OutputFormat format, const KeyValue<T> &field) {
+  using U = std::decay_t<T>;
+  const auto &value = field.value;
+  append_key(out, format, field.key);
+  if constexpr (std::is_same_v<U, bool>) {
+    append_value(out, format, value);
+  } else if constexpr (is_char_type<U>()) {
+    append_value(out, format, std::string_view(
+                                  reinterpret_cast<const char *>(&value), 1));
+  } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+    append_value(out, format, static_cast<long long>(value));
+  } else if constexpr (std::is_integral_v<U>) {
+    append_value(out, format, static_cast<unsigned long long>(value));
+  } else if constexpr (std::is_floating_point_v<U>) {
+    append_value(out, format, static_cast<double>(value));
+  } else if constexpr (is_char_array<T>()) {
+    append_value(out, format, std::string_view(value));
+  } else if constexpr (std::is_same_v<U, const char *> ||
+                       std::is_same_v<U, char *>) {
+    append_value(out, format,
+                 value ? std::string_view(value) : std::string_view("(null)"));
+  } else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+    append_value(out, format, std::string_view(value));
+  } else if constexpr (is_native_arg<T>()) {
+    append_value(out, format, reinterpret_cast<const void *>(value));
+  } else {
+    auto begin = begin_string(out, format);
+    if constexpr (is_lazy_arg<T>()) {
+      append_result(out, value);
+    } else {
+      buffer.stream() << value;
+      buffer.reset_stream();
+    }
+    end_string(out, begin, format);
+  }
+}
+
+// Written like what the function returned, as encode_arg() encodes it
+template <typename F>
+void append_field(ThreadLocalBuffer &buffer, LineBuffer &out,
+                  OutputFormat format, const KeyValue<LazyRef<F>> &field) {
+  const auto &result = field.value.fn();
+  append_field(buffer, out, format, kv(field.key, result));
+}
+
+template <typename T>
+void encode_field(std::string &out, const KeyValue<T> &field) {
+  put_string(out, field.key.name, ArgType::Key);
+  encode_arg(out, field.value);
+}
+
+// Appends the structured fields of a record's encoded arguments
+inline void decode_fields(std::string_view data, LineBuffer &out,
+                          OutputFormat format) {
+  const char *pos = data.data();
+  const char *end = pos + data.size();
+  bool field = false;
+  while (pos < end) {
+    auto type = static_cast<ArgType>(*pos++);
+    if (type == ArgType::Key) {
+      auto size = get_raw<std::uint32_t>(pos);
+      append_key(out, format, Key(std::string_view(pos, size)));
+      pos += size;
+      field = true;
+      continue;
+    }
+    switch (type) {
+    case ArgType::Bool:
+      if (field) {
+        append_value(out, format, *pos != 0);
+      }
+      ++pos;
+      break;
+    case ArgType::Char:
+      if (field) {
+        append_value(out, format, std::string_view(pos, 1));
+      }
+      ++pos;
+      break;
+    case ArgType::Int: {
+      auto value = get_raw<std::int64_t>(pos);
+      if (field) {
+        append_value(out, format, static_cast<long long>(value));
+      }
+      break;
+    }
+    case ArgType::UInt: {
+      auto value = get_raw<std::uint64_t>(pos);
+      if (field) {
+        append_value(out, format, static_cast<unsigned long long>(value));
+      }
+      break;
+    }
+    case ArgType::Double: {
+      auto value = get_raw<double>(pos);
+      if (field) {
+        append_value(out, format, value);
+      }
+      break;
+    }
+    case ArgType::String:
+    case ArgType::Key: {
+      auto size = get_raw<std::uint32_t>(pos);
+      if (field) {
+        append_value(out, format, std::string_view(pos, size));
+      }
+      pos += size;
+      break;
+    }
+    case ArgType::Pointer: {
+      auto value = get_raw<const void *>(pos);
+      if (field) {
+        append_value(out, format, value);
+      }
+      break;
+    }
+    case ArgType::Lazy: {
+      const auto *value = get_raw<const LazyArg *>(pos);
+      if (field) {
+        auto begin = begin_string(out, format);
+        value->format(out);
+        end_string(out, begin, format);
+      }
+      break;
+    }
+    }
+  }
+}
+
+// Turns a record's encoded arguments into its message text
+using DecodeFn = void (*)(std::string_view data, LineBuffer &out);
+
+// Format strings use "{}" placeholders, with "{{" and "}}" as escapes. They
+// are parsed at compile time into the unescaped literal text between
+// placeholders, so formatting is a memcpy per segment plus one per argument.
+struct FormatSegment {
+  std::size_t offset = 0;
+  std::size_t size = 0;
+};
+
+template <std::size_t Args, std::size_t Size> struct ParsedFormat {
+  char text[Size + 1] = {};
+  FormatSegment segments[Args + 1] = {};
+};
+
+// Not constexpr: reaching it during constant evaluation is a compile error
+inline void invalid_format_string(const char *) {}
+
+constexpr std::size_t count_placeholders(std::string_view pattern) {
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+    if (c == '{' && next == '}') {
+      ++count;
+      ++i;
+    } else if ((c == '{' && next == '{') || (c == '}' && next == '}')) {
+      ++i;
+    } else if (c == '{' || c == '}') {
+      invalid_format_string("unmatched brace; use {} or escape as {{ }}");
+    }
+  }
+  return count;
+}
+
+template <std::size_t Args, std::size_t Size>
+constexpr ParsedFormat<Args, Size> parse_format(std::string_view pattern) {
+  ParsedFormat<Args, Size> parsed{};
+  std::size_t size = 0;
+  std::size_t segment = 0;
+  for (std::size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+    if (c == '{' && next == '}') {
+      parsed.segments[segment].size = size - parsed.segments[segment].offset;
+      parsed.segments[++segment].offset = size;
+      ++i;
+      continue;
+    }
+    if ((c == '{' && next == '{') || (c == '}' && next == '}')) {
+      ++i;
+    }
+    parsed.text[size++] = c;
+  }
+  parsed.segments[segment].size = size - parsed.segments[segment].offset;
+  return parsed;
+}
+
+// `Pattern` is a type with `static constexpr std::string_view value()`
+template <typename Pattern> struct FormatSpec {
+  static constexpr std::string_view pattern = Pattern::value();
+  static constexpr std::size_t kArgs = count_placeholders(pattern);
+  static constexpr auto parsed = parse_format<kArgs, pattern.size()>(pattern);
+
+  template <std::size_t I> static constexpr std::string_view segment() {
+    return {parsed.text + parsed.segments[I].offset,
+            parsed.segments[I].size};
+  }
+};
+
+template <typename T>
+void append_arg(ThreadLocalBuffer &buffer, LineBuffer &out, const T &value) {
+  if constexpr (is_direct_arg<T>()) {
+    append_result(out, value);
+  } else {
+    buffer.stream() << value;
+    buffer.reset_stream();
+  }
+}
+
+template <typename Pattern, std::size_t... I, typename... Args>
+void append_formatted(std::index_sequence<I...>, ThreadLocalBuffer &buffer,
+                      LineBuffer &out, const Args &...args) {
+  using Spec = FormatSpec<Pattern>;
+  out.append(Spec::template segment<0>());
+  ((append_arg(buffer, out, args), out.append(Spec::template segment<I + 1>())),
+   ...);
+}
+
+template <typename Pattern, std::size_t... I>
+void decode_formatted(std::index_sequence<I...>, std::string_view data,
+                      LineBuffer &out) {
+  using Spec = FormatSpec<Pattern>;
+  [[maybe_unused]] const char *pos = data.data();
+  out.append(Spec::template segment<0>());
+  ((decode_arg(pos, out), out.append(Spec::template segment<I + 1>())), ...);
+}
+
+template <typename Pattern>
+void decode_formatted(std::string_view data, LineBuffer &out) {
+  decode_formatted<Pattern>(
+      std::make_index_sequence<FormatSpec<Pattern>::kArgs>{}, data, out);
+}
+
+// Binary log files, written by BinaryFileSink and read by log_decoder.cpp.
+// Every time the sink opens a file it writes kBinaryMagic, which starts a new
+// session: empty site and thread tables and a zero timestamp base. Entries
+// follow, each introduced by a BinaryTag:
+//   Site:   id, level, line, file, pattern
+//   Thread: id, name
+//   Args:   site id, thread id, timestamp delta, compact arguments
+//   Text:   site id, thread id, timestamp delta, message
+// Numbers are LEB128 varints, strings and argument blocks are prefixed with
+// their length, and timestamp deltas are zigzag nanoseconds since the
+// previous record. Compact arguments use the ArgType tags with varints for
+// integers, pointers and string lengths.
+constexpr std::string_view kBinaryMagic{"LOGB\x01", 5};
+
+enum class BinaryTag : std::uint8_t {
+  Site = 1,
+  Thread = 2,
+  Args = 3,
+  Text = 4,
+};
+
+inline void put_varint(std::string &out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out += static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+inline bool get_varint(const char *&pos, const char *end,
+                       std::uint64_t &value) {
+  value = 0;
+  for (int shift = 0; pos < end && shift < 64; shift += 7) {
+    auto byte = static_cast<std::uint8_t>(*pos++);
+    value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+constexpr std::uint64_t zigzag(std::int64_t value) {
+  return (static_cast<std::uint64_t>(value) << 1) ^
+         static_cast<std::uint64_t>(value >> 63);
+}
+
+constexpr std::int64_t unzigzag(std::uint64_t value) {
+  return static_cast<std::int64_t>(value >> 1) ^
+         -static_cast<std::int64_t>(value & 1);
+}
+
+inline void put_binary_string(std::string &out, std::string_view value) {
+  put_varint(out, value.size());
+  out.append(value.data(), value.size());
+}
+
+// Rewrites a record's encoded arguments in the compact file form
+inline void compact_args(std::string_view data, std::string &out) {
+  const char *pos = data.data();
+  const char *end = pos + data.size();
+  while (pos < end) {
+    auto type = static_cast<ArgType>(*pos++);
+    if (type == ArgType::Lazy) {
+      // Written as the string it formats to
+      thread_local LineBuffer text;
+      text.clear();
+      get_raw<const LazyArg *>(pos)->format(text);
+      out += static_cast<char>(ArgType::String);
+      put_binary_string(out, text.view());
+      continue;
+    }
+    out += static_cast<char>(type);
+    switch (type) {
+    case ArgType::Bool:
+    case ArgType::Char:
+      out += *pos++;
+      break;
+    case ArgType::Int:
+      put_varint(out, zigzag(get_raw<std::int64_t>(pos)));
+      break;
+    case ArgType::UInt:
+      put_varint(out, get_raw<std::uint64_t>(pos));
+      break;
+    case ArgType::Double:
+      put_raw(out, get_raw<double>(pos));
+      break;
+    case ArgType::String:
+    case ArgType::Key: {
+      auto size = get_raw<std::uint32_t>(pos);
+      put_binary_string(out, std::string_view(pos, size));
+      pos += size;
+      break;
+    }
+    case ArgType::Pointer:
+      put_varint(out, reinterpret_cast<std::uintptr_t>(
+                          get_raw<const void *>(pos)));
+      break;
+    case ArgType::Lazy:
+      break;
+    }
+  }
+}
+
+// Inverse of compact_args, producing input for decode_arg. Returns false if
+// the data is malformed.
+inline bool expand_args(std::string_view data, std::string &out) {
+  const char *pos = data.data();
+  const char *end = pos + data.size();
+  std::uint64_t value;
+  while (pos < end) {
+    auto type = static_cast<ArgType>(*pos++);
+    switch (type) {
+    case ArgType::Bool:
+    case ArgType::Char:
+      if (pos == end) {
+        return false;
+      }
+      out += static_cast<char>(type);
+      out += *pos++;
+      break;
+    case ArgType::Int:
+      if (!get_varint(pos, end, value)) {
+        return false;
+      }
+      out += static_cast<char>(type);
+      put_raw(out, unzigzag(value));
+      break;
+    case ArgType::UInt:
+      if (!get_varint(pos, end, value)) {
+        return false;
+      }
+      out += static_cast<char>(type);
+      put_raw(out, value);
+      break;
+    case ArgType::Double:
+      if (end - pos < static_cast<std::ptrdiff_t>(sizeof(double))) {
+        return false;
+      }
+      out += static_cast<char>(type);
+      put_raw(out, get_raw<double>(pos));
+      break;
+    case ArgType::String:
+    case ArgType::Key:
+      if (!get_varint(pos, end, value) ||
+          value > static_cast<std::uint64_t>(end - pos)) {
+        return false;
+      }
+      put_string(out, std::string_view(pos, value), type);
+      pos += value;
+      break;
+    case ArgType::Pointer:
+      if (!get_varint(pos, end, value)) {
+        return false;
+      }
+      out += static_cast<char>(type);
+      put_raw(out, reinterpret_cast<const void *>(
+                       static_cast<std::uintptr_t>(value)));
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+#if LOGGING_POSIX
+// Async-signal-safe write of the whole buffer
+inline void write_fd(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    auto n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+#endif
+
+// Housekeeping for rotating file sinks (compressing rotated files, opening
+// the next one) on a low-priority thread, so the sinks never wait for it.
+// Jobs run in order; those still pending at exit are finished first.
+class FileWorker {
+public:
+  static FileWorker &instance() {
+    static FileWorker instance;
+    return instance;
+  }
+
+  ~FileWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_requested_ = true;
+    }
+    cv_.notify_one();
+    if (worker_.joinable()) {
+      worker_.join();
+    }
+  }
+
+  void post(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(std::move(job));
+      if (!worker_.joinable()) {
+        worker_ = std::thread([this] { run(); });
+      }
+    }
+    cv_.notify_one();
+  }
+
+  // Waits until every job posted so far has run
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [&] { return jobs_.empty() && !busy_; });
+  }
+
+private:
+  FileWorker() = default;
+
+  void run() {
+#if defined(__linux__)
+    // Nice values apply per thread on Linux
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [&] { return stop_requested_ || !jobs_.empty(); });
+      if (jobs_.empty()) {
+        return;
+      }
+      auto job = std::move(jobs_.front());
+      jobs_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      job();
+      lock.lock();
+      busy_ = false;
+      if (jobs_.empty()) {
+        idle_cv_.notify_all();
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable idle_cv_;
+  std::deque<std::function<void()>> jobs_;
+  bool busy_ = false;
+  bool stop_requested_ = false;
+  std::thread worker_;
+};
+
+#if LOGGING_HAS_ZLIB
+// Writes a gzip copy of `from` to `to`; removes `to` on failure
+inline bool gzip_file(const std::string &from, const std::string &to) {
+  std::FILE *in = std::fopen(from.c_str(), "rb");
+  if (!in) {
+    return false;
+  }
+  gzFile out = ::gzopen(to.c_str(), "wb6");
+  bool ok = out != nullptr;
+  char chunk[1 << 16];
+  std::size_t n;
+  while (ok && (n = std::fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    ok = ::gzwrite(out, chunk, static_cast<unsigned>(n)) ==
+         static_cast<int>(n);
+  }
+  ok = ok && !std::ferror(in);
+  std::fclose(in);
+  if (out && ::gzclose(out) != Z_OK) {
+    ok = false;
+  }
+  if (!ok) {
+    std::remove(to.c_str());
+  }
+  return ok;
+}
+#endif
+
+} // namespace detail
+
+// A formatted record as handed to sinks. Views are only valid for the
+// duration of the Sink::write call.
+struct RecordView {
+  Level level;
+  std::chrono::system_clock::time_point time;
+  std::string_view thread;
+  std::string_view file;
+  int line;
+  std::string_view message; // Message body only
+  std::string_view text;    // Complete line, without colours, ending in '\n'
+  const void *site;         // Identifies the call site for the process lifetime
+  std::string_view pattern; // Format string of a LOG_*F call, else empty
+  std::string_view args;    // Encoded arguments of a deferred record, else empty
+  const Logger *logger;     // Named logger, or nullptr for the default one
+};
+
+namespace detail {
+inline void deliver_to_sinks(const RecordView *records, std::size_t count);
+} // namespace detail
+
+// Output destination. write() receives consecutive records in batches and
+// may buffer them; flush() is called according to the FlushPolicy. Calls are
+// never concurrent for the same sink.
+class Sink {
+public:
+  // Built-in sinks write out early once this much output is buffered
+  static constexpr std::size_t kMaxBuffer = 1 << 20;
+
+  virtual ~Sink() = default;
+  virtual void write(const RecordView *records, std::size_t count) = 0;
+  virtual void flush() {}
+  // Sinks that only read the structured fields return false. When no sink
+  // wants text, deferred records reach write() with `args` set and empty
+  // `text` and `message`, and are never formatted.
+  virtual bool wants_text() const { return true; }
+
+  // Used by the crash handler, possibly while another thread is inside
+  // write(): emergency_flush() writes out whatever is buffered, then each
+  // undelivered line is passed to emergency_write(). Both may only use
+  // async-signal-safe calls and must not lock or allocate.
+  virtual void emergency_flush() {}
+  virtual void emergency_write(std::string_view) {}
+
+  // Bytes of the records passed to write(): their text, or the encoded
+  // arguments of deferred records that were not formatted
+  std::uint64_t bytes_written() const {
+    return bytes_written_.load(std::memory_order_relaxed);
+  }
+
+private:
+  friend void detail::deliver_to_sinks(const RecordView *, std::size_t);
+
+  std::atomic<std::uint64_t> bytes_written_{0};
+};
+
+// Writes to a stream (std::cerr by default) with ANSI colours when
+// set_use_colours is on. Output is buffered until flush().
+class ConsoleSink : public Sink {
+public:
+  explicit ConsoleSink(std::ostream &stream = std::cerr)
+      : stream_(stream), fd_(descriptor(stream)) {
+    for (std::size_t i = 0; i < detail::kLevelCount; ++i) {
+      colours_[i] = "\033[";
+      colours_[i] += detail::get_colour_code(static_cast<Level>(i));
+      colours_[i] += 'm';
+    }
+  }
+
+  ~ConsoleSink() override { flush(); }
+
+  void write(const RecordView *records, std::size_t count) override {
+    bool use_colours = detail::State::Hold()->use_colours;
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto &record = records[i];
+      if (use_colours) {
+        buffer_ += colours_[static_cast<std::size_t>(record.level)];
+        buffer_.append(record.text.data(), record.text.size() - 1);
+        buffer_ += "\033[0m\n";
+      } else {
+        buffer_ += record.text;
+      }
+    }
+    if (buffer_.size() >= kMaxBuffer) {
+      flush();
+    }
+  }
+
+  void flush() override {
+    stream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    stream_.flush();
+    buffer_.clear();
+  }
+
+#if LOGGING_POSIX
+  // Only std::cout, std::cerr and std::clog have a known descriptor
+  void emergency_flush() override {
+    if (fd_ >= 0) {
+      detail::write_fd(fd_, buffer_.data(), buffer_.size());
+      buffer_.clear();
+    }
+  }
+
+  void emergency_write(std::string_view text) override {
+    if (fd_ >= 0) {
+      detail::write_fd(fd_, text.data(), text.size());
+    }
+  }
+#endif
+
+private:
+  static int descriptor(const std::ostream &stream) {
+    if (&stream == &std::cout) {
+      return 1;
+    }
+    if (&stream == &std::cerr || &stream == &std::clog) {
+      return 2;
+    }
+    return -1;
+  }
+
+  std::ostream &stream_;
+  int fd_;
+  std::string buffer_;
+  std::array<std::string, detail::kLevelCount> colours_; // Escape per level
+};
+
+// Appends to a file. Output is buffered until flush() and then written with a
+// single unbuffered fwrite.
+class FileSink : public Sink {
+public:
+  explicit FileSink(std::string path, bool truncate = false)
+      : path_(std::move(path)) {
+    open(truncate);
+  }
+
+  ~FileSink() override { close(); }
+
+  FileSink(const FileSink &) = delete;
+  FileSink &operator=(const FileSink &) = delete;
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      buffer_ += records[i].text;
+    }
+    if (buffer_.size() >= kMaxBuffer) {
+      flush();
+    }
+  }
+
+  void flush() override {
+    write_bytes(buffer_);
+    buffer_.clear();
+  }
+
+  const std::string &path() const { return path_; }
+
+#if LOGGING_POSIX
+  void emergency_flush() override {
+    if (fd_ >= 0) {
+      detail::write_fd(fd_, buffer_.data(), buffer_.size());
+      buffer_.clear();
+    }
+  }
+
+  void emergency_write(std::string_view text) override {
+    if (fd_ >= 0) {
+      detail::write_fd(fd_, text.data(), text.size());
+    }
+  }
+#endif
+
+protected:
+  void open(bool truncate) {
+    auto *file = std::fopen(path_.c_str(), truncate ? "wb" : "ab");
+    if (!file) {
+      throw std::runtime_error("logging: cannot open " + path_);
+    }
+    attach(file);
+  }
+
+  // Takes over an open file and appends to it
+  void attach(std::FILE *file) {
+    file_ = file;
+    std::setvbuf(file_, nullptr, _IONBF, 0);
+#if LOGGING_POSIX
+    fd_ = ::fileno(file_);
+#endif
+    std::fseek(file_, 0, SEEK_END);
+    long size = std::ftell(file_);
+    size_ = size > 0 ? static_cast<std::uint64_t>(size) : 0;
+  }
+
+  void close() {
+    if (file_) {
+      write_bytes(buffer_);
+      buffer_.clear();
+      std::fclose(file_);
+      file_ = nullptr;
+      fd_ = -1;
+    }
+  }
+
+  void write_bytes(std::string_view data) {
+    if (!data.empty()) {
+      std::fwrite(data.data(), 1, data.size(), file_);
+      size_ += data.size();
+    }
+  }
+
+  std::string path_;
+  std::FILE *file_ = nullptr;
+  int fd_ = -1; // Descriptor of file_, for the crash handler
+  std::uint64_t size_ = 0;
+  std::string buffer_;
+};
+
+// When RotatingFileSink starts a new file. Either limit may be zero.
+struct RotationPolicy {
+  std::uint64_t max_bytes = 0; // Before the file would exceed this size
+  // At every multiple of this since the epoch, so hours(24) rotates at
+  // midnight UTC
+  std::chrono::seconds interval{0};
+  std::size_t max_files = 5; // Rotated files kept as path.1 ... path.N
+  // Gzip rotated files to path.1.gz ... path.N.gz; needs LOGGING_HAS_ZLIB
+  bool compress = false;
+};
+
+// File sink that moves the file to path.1, shifting older ones up and
+// removing the oldest, whenever its RotationPolicy says so. The next file is
+// created ahead of time as path.next, and compression runs on a background
+// thread, so a rotation costs a few renames.
+class RotatingFileSink : public FileSink {
+public:
+  RotatingFileSink(std::string path, std::uint64_t max_bytes,
+                   std::size_t max_files)
+      : RotatingFileSink(std::move(path),
+                         RotationPolicy{max_bytes, std::chrono::seconds(0),
+                                        max_files, false}) {}
+
+  RotatingFileSink(std::string path, const RotationPolicy &policy)
+      : FileSink(std::move(path)), policy_(policy),
+        spare_(std::make_shared<Spare>()) {
+#if !LOGGING_HAS_ZLIB
+    if (policy_.compress) {
+      throw std::invalid_argument(
+          "logging: compressed rotation needs LOGGING_HAS_ZLIB");
+    }
+#endif
+    detail::FileWorker::instance();
+    spare_->path = path_ + ".next";
+    if (policy_.interval.count() > 0) {
+      next_rotation_ = boundary(std::chrono::system_clock::now());
+    }
+    prepare_spare();
+  }
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto &record = records[i];
+      bool due = policy_.interval.count() > 0 && record.time >= next_rotation_;
+      if (due) {
+        next_rotation_ = boundary(record.time);
+      }
+      bool full = policy_.max_bytes > 0 &&
+                  size_ + buffer_.size() + record.text.size() >
+                      policy_.max_bytes;
+      if ((due || full) && size_ + buffer_.size() > 0) {
+        rotate();
+      }
+      buffer_ += record.text;
+    }
+    if (buffer_.size() >= kMaxBuffer) {
+      flush();
+    }
+  }
+
+private:
+  // The pre-created next file, opened by the file worker
+  struct Spare {
+    ~Spare() {
+      if (file) {
+        std::fclose(file);
+        std::remove(path.c_str());
+      }
+    }
+
+    std::mutex mutex;
+    std::FILE *file = nullptr;
+    std::string path;
+  };
+
+  std::chrono::system_clock::time_point
+  boundary(std::chrono::system_clock::time_point time) const {
+    auto interval =
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            policy_.interval);
+    return std::chrono::system_clock::time_point(
+        (time.time_since_epoch() / interval + 1) * interval);
+  }
+
+  static std::string rotated_path(const std::string &path, std::size_t index,
+                                  const char *suffix = "") {
+    return path + "." + std::to_string(index) + suffix;
+  }
+
+  // Shifts path.1 ... path.N-1 up by one, dropping path.N
+  static void shift(const std::string &path, std::size_t max_files,
+                    const char *suffix) {
+    std::remove(rotated_path(path, max_files, suffix).c_str());
+    for (std::size_t i = max_files; i > 1; --i) {
+      std::rename(rotated_path(path, i - 1, suffix).c_str(),
+                  rotated_path(path, i, suffix).c_str());
+    }
+  }
+
+  void prepare_spare() {
+    detail::FileWorker::instance().post([spare = spare_] {
+      std::lock_guard<std::mutex> lock(spare->mutex);
+      if (!spare->file) {
+        spare->file = std::fopen(spare->path.c_str(), "wb");
+      }
+    });
+  }
+
+  void rotate() {
+    close();
+    if (policy_.max_files == 0) {
+      std::remove(path_.c_str());
+    } else if (!policy_.compress) {
+      shift(path_, policy_.max_files, "");
+      std::rename(path_.c_str(), rotated_path(path_, 1).c_str());
+    } else {
+      // The worker shifts the .gz files, so they are only touched by one
+      // thread, then compresses this one into path.1.gz
+      auto pending = path_ + ".rotated." + std::to_string(++rotations_);
+      std::rename(path_.c_str(), pending.c_str());
+#if LOGGING_HAS_ZLIB
+      detail::FileWorker::instance().post(
+          [path = path_, max_files = policy_.max_files, pending] {
+            shift(path, max_files, ".gz");
+            if (detail::gzip_file(pending, rotated_path(path, 1, ".gz"))) {
+              std::remove(pending.c_str());
+            }
+          });
+#endif
+    }
+
+    std::FILE *spare;
+    {
+      std::lock_guard<std::mutex> lock(spare_->mutex);
+      spare = std::exchange(spare_->file, nullptr);
+    }
+    if (spare && std::rename(spare_->path.c_str(), path_.c_str()) == 0) {
+      attach(spare);
+    } else {
+      if (spare) {
+        std::fclose(spare);
+      }
+      open(true);
+    }
+    prepare_spare();
+  }
+
+  RotationPolicy policy_;
+  std::shared_ptr<Spare> spare_;
+  std::chrono::system_clock::time_point next_rotation_;
+  std::uint64_t rotations_ = 0;
+};
+
+// Discards everything; useful for measuring formatting cost alone
+class NullSink : public Sink {
+public:
+  void write(const RecordView *, std::size_t) override {}
+};
+
+// Forwards each record to a user function
+class CallbackSink : public Sink {
+public:
+  using Callback = std::function<void(const RecordView &)>;
+
+  explicit CallbackSink(Callback callback) : callback_(std::move(callback)) {}
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      callback_(records[i]);
+    }
+  }
+
+private:
+  Callback callback_;
+};
+
+// Writes compact binary records instead of text; see kBinaryMagic for the
+// layout and log_decoder.cpp to turn a file back into log lines. Each call
+// site and thread name is written once per file. Only deferred records keep
+// their typed arguments; others store the formatted message.
+class BinaryFileSink : public FileSink {
+public:
+  explicit BinaryFileSink(std::string path, bool truncate = false)
+      : FileSink(std::move(path), truncate) {
+    buffer_ += detail::kBinaryMagic;
+  }
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto &record = records[i];
+      auto site = site_id(record);
+      auto thread = thread_id(record.thread);
+      auto tag = record.args.empty() ? detail::BinaryTag::Text
+                                     : detail::BinaryTag::Args;
+      std::int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              record.time.time_since_epoch())
+                              .count();
+      buffer_ += static_cast<char>(tag);
+      detail::put_varint(buffer_, site);
+      detail::put_varint(buffer_, thread);
+      detail::put_varint(buffer_, detail::zigzag(time - last_time_));
+      last_time_ = time;
+      if (tag == detail::BinaryTag::Args) {
+        scratch_.clear();
+        detail::compact_args(record.args, scratch_);
+        detail::put_binary_string(buffer_, scratch_);
+      } else {
+        detail::put_binary_string(buffer_, record.message);
+      }
+    }
+    if (buffer_.size() >= kMaxBuffer) {
+      flush();
+    }
+  }
+
+  bool wants_text() const override { return false; }
+
+  // Text lines have no place in the binary stream; only buffered records
+  // are written out
+  void emergency_write(std::string_view) override {}
+
+private:
+  std::uint64_t site_id(const RecordView &record) {
+    auto it = sites_.find(record.site);
+    if (it != sites_.end()) {
+      return it->second;
+    }
+    auto id = static_cast<std::uint64_t>(sites_.size());
+    sites_.emplace(record.site, id);
+    buffer_ += static_cast<char>(detail::BinaryTag::Site);
+    detail::put_varint(buffer_, id);
+    buffer_ += static_cast<char>(record.level);
+    detail::put_varint(buffer_, static_cast<std::uint64_t>(record.line));
+    detail::put_binary_string(buffer_, record.file);
+    detail::put_binary_string(buffer_, record.pattern);
+    return id;
+  }
+
+  std::uint64_t thread_id(std::string_view name) {
+    if (!threads_.empty() && name == last_thread_name_) {
+      return last_thread_;
+    }
+    auto it = threads_.find(name);
+    if (it == threads_.end()) {
+      it = threads_.emplace(std::string(name), threads_.size()).first;
+      buffer_ += static_cast<char>(detail::BinaryTag::Thread);
+      detail::put_varint(buffer_, it->second);
+      detail::put_binary_string(buffer_, name);
+    }
+    last_thread_name_ = it->first;
+    last_thread_ = it->second;
+    return last_thread_;
+  }
+
+  std::unordered_map<const void *, std::uint64_t> sites_;
+  std::map<std::string, std::uint64_t, std::less<>> threads_;
+  std::string last_thread_name_;
+  std::uint64_t last_thread_ = 0;
+  std::int64_t last_time_ = 0;
+  std::string scratch_;
+};
+
+#if LOGGING_POSIX
+// Writes lines straight into memory-mapped segment files path.0, path.1, ...
+// Each segment is preallocated to `segment_bytes`, rolled before a line that
+// would not fit and trimmed to its used size when closed. Text is in the page
+// cache as soon as write() returns, so it survives a crash of the process
+// (not of the machine); a segment left behind by a crash ends in zero bytes.
+// Starts at the first unused segment index.
+class MmapFileSink : public Sink {
+public:
+  static constexpr std::size_t kDefaultSegmentBytes = 64 << 20;
+
+  explicit MmapFileSink(std::string path,
+                        std::size_t segment_bytes = kDefaultSegmentBytes)
+      : path_(std::move(path)),
+        segment_bytes_(std::max<std::size_t>(segment_bytes, 1)) {
+    while (::access(segment_path(index_).c_str(), F_OK) == 0) {
+      ++index_;
+    }
+    if (!open_segment()) {
+      throw std::runtime_error("logging: cannot map " + segment_path(index_));
+    }
+  }
+
+  ~MmapFileSink() override { close_segment(); }
+
+  MmapFileSink(const MmapFileSink &) = delete;
+  MmapFileSink &operator=(const MmapFileSink &) = delete;
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      std::string_view text = records[i].text;
+      while (!text.empty() && data_) {
+        // Lines only span segments when longer than one
+        if (used_ == segment_bytes_ ||
+            (used_ > 0 && used_ + text.size() > segment_bytes_)) {
+          close_segment();
+          ++index_;
+          open_segment(); // On failure output is dropped
+          continue;
+        }
+        std::size_t n = std::min(text.size(), segment_bytes_ - used_);
+        std::memcpy(data_ + used_, text.data(), n);
+        used_ += n;
+        text.remove_prefix(n);
+      }
+    }
+  }
+
+  // Copies what fits in the current segment
+  void emergency_write(std::string_view text) override {
+    if (data_) {
+      std::size_t n = std::min(text.size(), segment_bytes_ - used_);
+      std::memcpy(data_ + used_, text.data(), n);
+      used_ += n;
+    }
+  }
+
+  // Path of the segment currently being written
+  std::string current_path() const { return segment_path(index_); }
+
+private:
+  std::string segment_path(std::size_t index) const {
+    return path_ + "." + std::to_string(index);
+  }
+
+  bool open_segment() {
+    fd_ = ::open(segment_path(index_).c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                 0644);
+    if (fd_ < 0) {
+      return false;
+    }
+    auto size = static_cast<off_t>(segment_bytes_);
+#if defined(__linux__)
+    // Reserve the blocks now so a full disk can't fault the mapping later
+    bool allocated = ::posix_fallocate(fd_, 0, size) == 0;
+#else
+    bool allocated = ::ftruncate(fd_, size) == 0;
+#endif
+    void *data = allocated ? ::mmap(nullptr, segment_bytes_,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)
+                           : MAP_FAILED;
+    if (data == MAP_FAILED) {
+      ::close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    data_ = static_cast<char *>(data);
+    used_ = 0;
+    return true;
+  }
+
+  void close_segment() {
+    if (data_) {
+      ::munmap(data_, segment_bytes_);
+      data_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      [[maybe_unused]] int result =
+          ::ftruncate(fd_, static_cast<off_t>(used_));
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  std::string path_;
+  std::size_t segment_bytes_;
+  std::size_t index_ = 0;
+  int fd_ = -1;
+  char *data_ = nullptr;
+  std::size_t used_ = 0;
+};
+#endif
+
+#if LOGGING_POSIX
+namespace detail {
+
+// Writes `size` bytes at `offset`, retrying short writes; false on error
+inline bool pwrite_fd(int fd, const char *data, std::size_t size,
+                      std::uint64_t offset) {
+  while (size > 0) {
+    auto n = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<std::size_t>(n);
+    offset += static_cast<std::uint64_t>(n);
+  }
+  return true;
+}
+
+#if LOGGING_HAS_IO_URING
+// The few io_uring operations UringFileSink needs, on the raw system calls
+// so there is no liburing dependency. Not thread-safe.
+class Uring {
+public:
+  Uring() = default;
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  ~Uring() {
+    if (sqes_) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+      ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  // False if the kernel has no io_uring or it is not permitted
+  bool open(unsigned entries) {
+    io_uring_params params{};
+    fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (fd_ < 0) {
+      return false;
+    }
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    if (!sq_ring_) {
+      return false;
+    }
+    cq_ring_ = single ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, IORING_OFF_SQES));
+    if (!cq_ring_ || !sqes_) {
+      return false;
+    }
+    auto *sq = static_cast<char *>(sq_ring_);
+    auto *cq = static_cast<char *>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  // Pins the buffers so writes from them skip the per-call page mapping
+  bool register_buffers(const struct iovec *buffers, unsigned count) {
+    return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS,
+                     buffers, count) == 0;
+  }
+
+  // Queues a write of data[0, size) at `offset`; `buffer` is the index of the
+  // registered buffer holding it, or -1. Call submit() to start it. The ring
+  // must have been opened with at least as many entries as writes queued
+  // between submissions.
+  void write(int fd, const char *data, unsigned size, std::uint64_t offset,
+             int buffer, std::uint64_t user_data) {
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    auto &sqe = sqes_[index];
+    sqe = {};
+    sqe.opcode = buffer >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(data);
+    sqe.len = size;
+    sqe.off = offset;
+    sqe.buf_index = static_cast<std::uint16_t>(buffer >= 0 ? buffer : 0);
+    sqe.user_data = user_data;
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++queued_;
+  }
+
+  // Starts the queued writes and waits for at least `wait_for` completions
+  bool submit(unsigned wait_for = 0) {
+    while (true) {
+      auto result = ::syscall(__NR_io_uring_enter, fd_, queued_, wait_for,
+                              wait_for > 0 ? IORING_ENTER_GETEVENTS : 0,
+                              nullptr, 0);
+      if (result >= 0) {
+        queued_ -= static_cast<unsigned>(result);
+        if (queued_ == 0 || wait_for == 0) {
+          return true;
+        }
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return false;
+      }
+    }
+  }
+
+  // Calls fn(user_data, result) for each completed write
+  template <typename F> void reap(F &&fn) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      const auto &cqe = cqes_[head & cq_mask_];
+      fn(cqe.user_data, cqe.res);
+      ++head;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  void *map(std::size_t size, off_t offset) {
+    void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, offset);
+    return data == MAP_FAILED ? nullptr : data;
+  }
+
+  int fd_ = -1;
+  void *sq_ring_ = nullptr;
+  void *cq_ring_ = nullptr;
+  io_uring_sqe *sqes_ = nullptr;
+  std::size_t sq_ring_size_ = 0;
+  std::size_t cq_ring_size_ = 0;
+  std::size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  unsigned queued_ = 0;
+};
+#endif
+
+} // namespace detail
+
+// Appends lines to a file through io_uring on Linux, so the thread calling
+// write() and flush() (the backend, in async mode) copies into a buffer and
+// never blocks in write(2). Each flush submits the filled buffer as one write
+// at its own file offset and moves on to the next of `buffers` registered
+// buffers; a buffer is reused once its write completes, and the thread only
+// waits when all of them are still in flight. Where io_uring is unavailable
+// (other systems, older kernels, seccomp) it falls back to one plain write
+// per flush. Records reach the file in order; only this sink may write to it.
+class UringFileSink : public Sink {
+public:
+  static constexpr std::size_t kDefaultBufferBytes = 1 << 20;
+  static constexpr unsigned kDefaultBuffers = 8;
+
+  explicit UringFileSink(std::string path, bool truncate = false,
+                         std::size_t buffer_bytes = kDefaultBufferBytes,
+                         unsigned buffers = kDefaultBuffers)
+      : path_(std::move(path)),
+        buffer_bytes_(std::max<std::size_t>(buffer_bytes, 4096)) {
+    fd_ = ::open(path_.c_str(),
+                 O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0),
+                 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("logging: cannot open " + path_);
+    }
+    auto end = ::lseek(fd_, 0, SEEK_END);
+    offset_ = end > 0 ? static_cast<std::uint64_t>(end) : 0;
+#if LOGGING_HAS_IO_URING
+    buffers = std::clamp(buffers, 2u, 64u);
+    if (ring_.open(buffers)) {
+      using_ring_ = true;
+    }
+#endif
+    buffers_.resize(using_ring_ ? buffers : 1);
+    std::vector<struct iovec> iov(buffers_.size());
+    for (std::size_t i = 0; i < buffers_.size(); ++i) {
+      buffers_[i].data.reset(new char[buffer_bytes_]);
+      iov[i].iov_base = buffers_[i].data.get();
+      iov[i].iov_len = buffer_bytes_;
+      free_.push_back(static_cast<unsigned>(i));
+    }
+#if LOGGING_HAS_IO_URING
+    fixed_ = using_ring_ && ring_.register_buffers(
+                                iov.data(), static_cast<unsigned>(iov.size()));
+#endif
+    current_ = take_free();
+  }
+
+  ~UringFileSink() override {
+    flush();
+    wait_all();
+    ::close(fd_);
+  }
+
+  UringFileSink(const UringFileSink &) = delete;
+  UringFileSink &operator=(const UringFileSink &) = delete;
+
+  void write(const RecordView *records, std::size_t count) override {
+    for (std::size_t i = 0; i < count; ++i) {
+      std::string_view text = records[i].text;
+      while (!text.empty()) {
+        auto &buffer = buffers_[current_];
+        auto n = std::min(text.size(), buffer_bytes_ - buffer.used);
+        std::memcpy(buffer.data.get() + buffer.used, text.data(), n);
+        buffer.used += n;
+        text.remove_prefix(n);
+        if (buffer.used == buffer_bytes_) {
+          flush();
+        }
+      }
+    }
+  }
+
+  // Submits the current buffer without waiting for it to be written
+  void flush() override {
+    auto &buffer = buffers_[current_];
+    if (buffer.used == 0) {
+      return;
+    }
+    buffer.offset = offset_;
+    offset_ += buffer.used;
+    if (!using_ring_) {
+      detail::pwrite_fd(fd_, buffer.data.get(), buffer.used, buffer.offset);
+      buffer.used = 0;
+      return;
+    }
+#if LOGGING_HAS_IO_URING
+    buffer.done = 0;
+    buffer.submitted = true;
+    start(current_);
+    current_ = take_free();
+#endif
+  }
+
+  // Writes still in flight when the process crashes complete in the kernel;
+  // the current buffer is written directly behind them
+  void emergency_flush() override {
+    auto &buffer = buffers_[current_];
+    if (buffer.used > 0) {
+      detail::pwrite_fd(fd_, buffer.data.get(), buffer.used, offset_);
+      offset_ += buffer.used;
+      buffer.used = 0;
+    }
+  }
+
+  void emergency_write(std::string_view text) override {
+    detail::pwrite_fd(fd_, text.data(), text.size(), offset_);
+    offset_ += text.size();
+  }
+
+  const std::string &path() const { return path_; }
+
+  // False when writes fall back to pwrite(2)
+  bool uses_io_uring() const { return using_ring_; }
+
+private:
+  struct Buffer {
+    std::unique_ptr<char[]> data;
+    std::size_t used = 0;
+    std::size_t done = 0; // Bytes the kernel has written so far
+    std::uint64_t offset = 0;
+    bool submitted = false;
+  };
+
+  unsigned take_free() {
+#if LOGGING_HAS_IO_URING
+    if (using_ring_) {
+      reap();
+      while (free_.empty() && ring_.submit(1)) {
+        reap();
+      }
+      if (free_.empty()) {
+        // The ring broke; finish everything with pwrite from here on
+        finish_in_place();
+      }
+    }
+#endif
+    auto index = free_.back();
+    free_.pop_back();
+    return index;
+  }
+
+#if LOGGING_HAS_IO_URING
+  void start(unsigned index) {
+    auto &buffer = buffers_[index];
+    ring_.write(fd_, buffer.data.get() + buffer.done,
+                static_cast<unsigned>(buffer.used - buffer.done),
+                buffer.offset + buffer.done,
+                fixed_ ? static_cast<int>(index) : -1, index);
+    ++in_flight_;
+    if (!ring_.submit()) {
+      finish_in_place();
+    }
+  }
+
+  void reap() {
+    ring_.reap([&](std::uint64_t index, int result) {
+      auto &buffer = buffers_[index];
+      if (!buffer.submitted) {
+        return; // Already written by finish_in_place()
+      }
+      --in_flight_;
+      if (result == -EINTR || result == -EAGAIN) {
+        start(static_cast<unsigned>(index));
+        return;
+      }
+      if (result > 0) {
+        buffer.done += static_cast<std::size_t>(result);
+        if (buffer.done < buffer.used) {
+          start(static_cast<unsigned>(index)); // Short write
+          return;
+        }
+      } else {
+        // Retry synchronously so the error shows up as it would for write()
+        detail::pwrite_fd(fd_, buffer.data.get() + buffer.done,
+                          buffer.used - buffer.done,
+                          buffer.offset + buffer.done);
+      }
+      buffer.used = 0;
+      buffer.submitted = false;
+      free_.push_back(static_cast<unsigned>(index));
+    });
+  }
+
+  // Falls back to pwrite for good: waits out what the kernel took, then
+  // writes everything else directly
+  void finish_in_place() {
+    using_ring_ = false;
+    free_.clear();
+    for (unsigned i = 0; i < buffers_.size(); ++i) {
+      auto &buffer = buffers_[i];
+      if (buffer.submitted) {
+        detail::pwrite_fd(fd_, buffer.data.get() + buffer.done,
+                          buffer.used - buffer.done,
+                          buffer.offset + buffer.done);
+        buffer.used = 0;
+        buffer.submitted = false;
+      } else if (i == current_) {
+        continue; // Still being filled
+      }
+      free_.push_back(i);
+    }
+    in_flight_ = 0;
+  }
+#endif
+
+  void wait_all() {
+#if LOGGING_HAS_IO_URING
+    while (using_ring_ && in_flight_ > 0) {
+      if (!ring_.submit(1)) {
+        finish_in_place();
+        break;
+      }
+      reap();
+    }
+#endif
+  }
+
+  std::string path_;
+  std::size_t buffer_bytes_;
+  int fd_ = -1;
+  std::uint64_t offset_ = 0; // Where the next submitted buffer goes
+  std::vector<Buffer> buffers_;
+  std::vector<unsigned> free_;
+  unsigned current_ = 0;
+  bool using_ring_ = false;
+#if LOGGING_HAS_IO_URING
+  detail::Uring ring_;
+  bool fixed_ = false;
+  unsigned in_flight_ = 0;
+#endif
+};
+#endif
+
+#if LOGGING_POSIX
+// Sends records to a syslog collector as RFC 5424 messages, either one UDP
+// datagram each or octet-counted frames (RFC 6587) on a TCP stream. Records
+// are batched until flush() and handed to the sink's own sender thread, which
+// writes each batch with one sendmmsg() (UDP, on Linux) or a single send()
+// (TCP), so neither producers nor the async backend wait on the network.
+// Connecting and reconnecting with exponential backoff also happen there;
+// while the collector is unreachable up to `max_pending` bytes are kept and
+// the oldest batches beyond that are dropped.
+class SyslogSink : public Sink {
+public:
+  enum class Transport : std::uint8_t { Udp, Tcp };
+
+  struct Options {
+    std::string host = "127.0.0.1";
+    std::uint16_t port = 514;
+    Transport transport = Transport::Udp;
+    std::string app_name = "-";
+    int facility = 1; // user-level messages
+    std::size_t max_pending = 4 << 20;
+  };
+
+  // UDP datagrams are cut to this size; collectors are only required to
+  // accept 480 bytes, most take far more
+  static constexpr std::size_t kMaxDatagram = 8192;
+
+  explicit SyslogSink(Options options) : options_(std::move(options)) {
+    if (options_.facility < 0 || options_.facility > 23) {
+      throw std::invalid_argument("logging: syslog facility must be 0-23");
+    }
+    char host[256] = {};
+    if (::gethostname(host, sizeof(host) - 1) != 0 || host[0] == '\0') {
+      host[0] = '-';
+    }
+    header_suffix_ = ' ';
+    header_suffix_ += host;
+    header_suffix_ += ' ';
+    header_suffix_ += options_.app_name.empty() ? "-" : options_.app_name;
+    header_suffix_ += ' ';
+    header_suffix_ += std::to_string(::getpid());
+    sender_ = std::thread([this] { run(); });
+  }
+
+  ~SyslogSink() override {
+    flush();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_requested_ = true;
+    }
+    cv_.notify_one();
+    sender_.join();
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  void write(const RecordView *records, std::size_t count) override {
+    bool tcp = options_.transport == Transport::Tcp;
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto &record = records[i];
+      message_.clear();
+      format(record, message_);
+      if (tcp) {
+        batch_.data += std::to_string(message_.size());
+        batch_.data += ' ';
+      } else if (message_.size() > kMaxDatagram) {
+        message_.resize(kMaxDatagram);
+      }
+      batch_.data += message_;
+      batch_.ends.push_back(batch_.data.size());
+    }
+    if (batch_.data.size() >= kMaxBuffer) {
+      flush();
+    }
+  }
+
+  // Hands the batch to the sender thread without waiting for it to be sent
+  void flush() override {
+    if (batch_.ends.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_bytes_ += batch_.data.size();
+      pending_.push_back(std::move(batch_));
+      trim();
+    }
+    batch_ = {};
+    cv_.notify_one();
+  }
+
+  // Records sent to the collector, and records discarded because it was
+  // unreachable for too long or refused them
+  std::uint64_t sent() const { return sent_.load(std::memory_order_relaxed); }
+  std::uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  // Waits until every batch flushed so far has been sent or dropped
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [&] { return pending_.empty() && !busy_; });
+  }
+
+private:
+  struct Batch {
+    std::string data;
+    std::vector<std::size_t> ends; // End offset of each message in `data`
+  };
+
+  static constexpr std::chrono::milliseconds kMinBackoff{100};
+  static constexpr std::chrono::milliseconds kMaxBackoff{30000};
+  static constexpr int kConnectTimeoutMs = 1000;
+
+  static int severity(Level level) {
+    switch (level) {
+    case Level::TRACE:
+    case Level::DEBUG:
+      return 7;
+    case Level::INFO:
+      return 6;
+    case Level::WARN:
+      return 4;
+    case Level::ERROR:
+      return 3;
+    case Level::FATAL:
+      return 2;
+    }
+    return 6;
+  }
+
+  // <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID - MSG
+  void format(const RecordView &record, std::string &out) {
+    out += '<';
+    out += std::to_string(options_.facility * 8 + severity(record.level));
+    out += ">1 ";
+    append_timestamp(record.time, out);
+    out += header_suffix_;
+    out += ' ';
+    // MSGID is a printable token of at most 32 characters
+    std::string_view name =
+        record.logger ? std::string_view(record.logger->name()) : "";
+    bool token = !name.empty() && name.size() <= 32 &&
+                 std::all_of(name.begin(), name.end(),
+                             [](char c) { return c > ' ' && c < 127; });
+    if (token) {
+      out += name;
+    } else {
+      out += '-';
+    }
+    out += " - ";
+    out += record.message;
+  }
+
+  // RFC 3339 in UTC with microseconds; the date part is cached per second
+  void append_timestamp(std::chrono::system_clock::time_point time,
+                        std::string &out) {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                      time.time_since_epoch())
+                      .count();
+    auto seconds = micros / 1000000;
+    auto fraction = micros % 1000000;
+    if (fraction < 0) {
+      fraction += 1000000;
+      --seconds;
+    }
+    if (seconds != cached_second_ || cached_date_.empty()) {
+      auto time_t = static_cast<std::time_t>(seconds);
+      std::tm tm{};
+      ::gmtime_r(&time_t, &tm);
+      char date[32];
+      std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+      cached_date_ = date;
+      cached_second_ = seconds;
+    }
+    char digits[8];
+    std::snprintf(digits, sizeof(digits), ".%06d", static_cast<int>(fraction));
+    out += cached_date_;
+    out += digits;
+    out += 'Z';
+  }
+
+  // Drops the oldest batches while over the limit; call with mutex_ held
+  void trim() {
+    while (pending_bytes_ > options_.max_pending && pending_.size() > 1) {
+      pending_bytes_ -= pending_.front().data.size();
+      dropped_.fetch_add(pending_.front().ends.size(),
+                         std::memory_order_relaxed);
+      pending_.pop_front();
+    }
+  }
+
+  void run() {
+    auto backoff = kMinBackoff;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [&] { return stop_requested_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      auto batch = std::move(pending_.front());
+      pending_.pop_front();
+      pending_bytes_ -= batch.data.size();
+      busy_ = true;
+      lock.unlock();
+      bool sent = send(batch);
+      lock.lock();
+      busy_ = false;
+      if (sent) {
+        backoff = kMinBackoff;
+      } else if (stop_requested_) {
+        // Give up on what is left rather than hold up the destructor
+        for (const auto &unsent : pending_) {
+          dropped_.fetch_add(unsent.ends.size(), std::memory_order_relaxed);
+        }
+        dropped_.fetch_add(batch.ends.size(), std::memory_order_relaxed);
+        pending_.clear();
+        pending_bytes_ = 0;
+      } else {
+        pending_bytes_ += batch.data.size();
+        pending_.push_front(std::move(batch));
+        trim();
+        cv_.wait_for(lock, backoff, [&] { return stop_requested_; });
+        backoff = std::min(backoff * 2, kMaxBackoff);
+      }
+      if (pending_.empty()) {
+        idle_cv_.notify_all();
+      }
+    }
+  }
+
+  // Returns false if the batch should be retried after a backoff
+  bool send(Batch &batch) {
+    if (fd_ < 0 && !connect()) {
+      return false;
+    }
+    if (options_.transport == Transport::Tcp) {
+      if (!send_stream(batch)) {
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+      }
+      sent_.fetch_add(batch.ends.size(), std::memory_order_relaxed);
+    } else {
+      auto failed = send_datagrams(batch);
+      dropped_.fetch_add(failed, std::memory_order_relaxed);
+      sent_.fetch_add(batch.ends.size() - failed, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  // Resumes after a short write; a batch cut off by a broken connection is
+  // resent whole, so the collector may see its first records twice
+  bool send_stream(const Batch &batch) {
+    const char *data = batch.data.data();
+    std::size_t left = batch.data.size();
+    while (left > 0) {
+      auto n = ::send(fd_, data, left, kSendFlags);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += n;
+      left -= static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+
+  // Returns how many datagrams could not be sent. Ones the collector drops
+  // are lost without notice.
+  std::size_t send_datagrams(const Batch &batch) {
+    std::size_t total = batch.ends.size();
+    std::size_t failed = 0;
+#if defined(__linux__)
+    constexpr std::size_t kChunk = 256;
+    struct iovec iov[kChunk];
+    struct mmsghdr headers[kChunk];
+    for (std::size_t first = 0; first < total; first += kChunk) {
+      std::size_t n = std::min(kChunk, total - first);
+      for (std::size_t i = 0; i < n; ++i) {
+        std::size_t begin = first + i == 0 ? 0 : batch.ends[first + i - 1];
+        iov[i].iov_base = const_cast<char *>(batch.data.data() + begin);
+        iov[i].iov_len = batch.ends[first + i] - begin;
+        headers[i] = {};
+        headers[i].msg_hdr.msg_iov = &iov[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+      }
+      std::size_t done = 0;
+      while (done < n) {
+        int result = ::sendmmsg(fd_, headers + done,
+                                static_cast<unsigned>(n - done), kSendFlags);
+        if (result < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          // Skip the datagram that failed and carry on with the rest
+          ++failed;
+          ++done;
+          continue;
+        }
+        done += static_cast<std::size_t>(result);
+      }
+    }
+#else
+    for (std::size_t i = 0; i < total; ++i) {
+      std::size_t begin = i == 0 ? 0 : batch.ends[i - 1];
+      if (::send(fd_, batch.data.data() + begin, batch.ends[i] - begin,
+                 kSendFlags) < 0) {
+        ++failed;
+      }
+    }
+#endif
+    return failed;
+  }
+
+  // Resolves the collector and connects, waiting at most kConnectTimeoutMs
+  bool connect() {
+    bool tcp = options_.transport == Transport::Tcp;
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+    struct addrinfo *addresses = nullptr;
+    auto port = std::to_string(options_.port);
+    if (::getaddrinfo(options_.host.c_str(), port.c_str(), &hints,
+                      &addresses) != 0) {
+      return false;
+    }
+    for (auto *address = addresses; address && fd_ < 0;
+         address = address->ai_next) {
+      int fd = ::socket(address->ai_family, address->ai_socktype,
+                        address->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      int flags = ::fcntl(fd, F_GETFL);
+      ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      bool connected =
+          ::connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+      if (!connected && errno == EINPROGRESS) {
+        struct pollfd poll_fd = {fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t size = sizeof(error);
+        connected =
+            ::poll(&poll_fd, 1, kConnectTimeoutMs) == 1 &&
+            ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 &&
+            error == 0;
+      }
+      if (connected) {
+        ::fcntl(fd, F_SETFL, flags);
+        fd_ = fd;
+      } else {
+        ::close(fd);
+      }
+    }
+    ::freeaddrinfo(addresses);
+    return fd_ >= 0;
+  }
+
+#if defined(MSG_NOSIGNAL)
+  static constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+  static constexpr int kSendFlags = 0;
+#endif
+
+  Options options_;
+  std::string header_suffix_; // " HOSTNAME APP-NAME PROCID"
+  std::string message_;
+  std::string cached_date_;
+  std::int64_t cached_second_ = 0;
+  Batch batch_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable idle_cv_;
+  std::deque<Batch> pending_;
+  std::size_t pending_bytes_ = 0;
+  bool busy_ = false;
+  bool stop_requested_ = false;
+  int fd_ = -1; // Used by the sender thread only
+  std::atomic<std::uint64_t> sent_{0};
+  std::atomic<std::uint64_t> dropped_{0};
+  std::thread sender_;
+};
+#endif
+
+namespace detail {
+
+// Serialises sink access and sink-list changes
+inline std::mutex &output_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+inline Sink &default_sink() {
+  static ConsoleSink sink;
+  return sink;
+}
+
+using SinkList = std::vector<std::shared_ptr<Sink>>;
+
+// Named loggers by name. Loggers are never removed, so the list can be
+// walked without the lock, even from the crash handler.
+class LoggerRegistry {
+public:
+  static LoggerRegistry &instance() {
+    static LoggerRegistry instance;
+    return instance;
+  }
+
+  Logger &get(std::string_view name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_name_.find(name);
+    if (it != by_name_.end()) {
+      return *it->second;
+    }
+    auto level = State::instance().level();
+    std::unique_ptr<Logger> logger(new Logger(name, level));
+    logger->next_ = head_.load(std::memory_order_relaxed);
+    head_.store(logger.get(), std::memory_order_release);
+    auto &result = *logger;
+    by_name_.emplace(std::string(name), std::move(logger));
+    return result;
+  }
+
+  template <typename Apply> void for_each(Apply &&apply) const {
+    for (auto *logger = head_.load(std::memory_order_acquire); logger;
+         logger = logger->next_) {
+      apply(*logger);
+    }
+  }
+
+  // Where records of `logger` go; empty means the default console sink.
+  // Caller must hold output_mutex().
+  static const SinkList &sinks(const Logger *logger) {
+    if (logger && !logger->sinks_.empty()) {
+      return logger->sinks_;
+    }
+    return State::instance().sinks;
+  }
+
+  static SinkList &own_sinks(Logger &logger) { return logger.sinks_; }
+
+  static LineOptions options(const Config &config, const Logger *logger) {
+    auto options = line_options(config);
+    if (logger) {
+      auto location = logger->include_location_.load(std::memory_order_relaxed);
+      auto thread = logger->include_thread_id_.load(std::memory_order_relaxed);
+      if (location != Logger::kUnset) {
+        options.include_location = location != 0;
+      }
+      if (thread != Logger::kUnset) {
+        options.include_thread_id = thread != 0;
+      }
+    }
+    return options;
+  }
+
+  static Level level(const Logger &logger) {
+    return logger.level_.load(std::memory_order_relaxed);
+  }
+
+  // Without recomputing call sites; returns whether the level changed
+  static bool set_level(Logger &logger, Level level) {
+    return logger.level_.exchange(level, std::memory_order_relaxed) != level;
+  }
+
+private:
+  LoggerRegistry() { State::instance(); }
+
+  std::mutex mutex_;
+  std::map<std::string, std::unique_ptr<Logger>, std::less<>> by_name_;
+  std::atomic<Logger *> head_{nullptr};
+};
+
+// Applies `apply` to each sink in `sinks`, or to the default sink if empty
+template <typename Apply> void each_sink(const SinkList &sinks, Apply &&apply) {
+  if (sinks.empty()) {
+    apply(default_sink());
+  }
+  for (const auto &sink : sinks) {
+    apply(*sink);
+  }
+}
+
+// Every sink in use: the default logger's and the named loggers' own
+template <typename Apply> void each_active_sink(Apply &&apply) {
+  each_sink(State::instance().sinks, apply);
+  LoggerRegistry::instance().for_each([&](Logger &logger) {
+    for (const auto &sink : LoggerRegistry::own_sinks(logger)) {
+      apply(*sink);
+    }
+  });
+}
+
+// Caller must hold output_mutex()
+inline void flush_sinks() {
+  each_active_sink([](Sink &sink) { sink.flush(); });
+  State::instance().pending_bytes = 0;
+}
+
+// Whether any active sink reads RecordView::text. Caller must hold
+// output_mutex().
+inline bool sinks_want_text() {
+  bool want_text = false;
+  each_active_sink([&](Sink &sink) {
+    want_text = want_text || sink.wants_text();
+  });
+  return want_text;
+}
+
+// Writes a batch and applies the flush-on-level and size parts of the
+// FlushPolicy. Caller must hold output_mutex().
+inline void deliver_to_sinks(const RecordView *records, std::size_t count) {
+  if (count == 0) {
+    return;
+  }
+  auto &state = State::instance();
+  State::Hold config;
+  bool urgent = false;
+  // Each run of records bound for the same sinks is written in one call
+  for (std::size_t begin = 0, end; begin < count; begin = end) {
+    const auto &sinks = LoggerRegistry::sinks(records[begin].logger);
+    std::size_t bytes = 0;
+    for (end = begin; end < count; ++end) {
+      const auto &record = records[end];
+      if (end > begin && &LoggerRegistry::sinks(record.logger) != &sinks) {
+        break;
+      }
+      bytes += record.text.empty() ? record.args.size() : record.text.size();
+      ++state.written[static_cast<std::size_t>(record.level)];
+      urgent = urgent || record.level >= config->flush_level;
+    }
+    state.pending_bytes += bytes;
+    each_sink(sinks, [&](Sink &sink) {
+      sink.write(records + begin, end - begin);
+      sink.bytes_written_.store(
+          sink.bytes_written_.load(std::memory_order_relaxed) + bytes,
+          std::memory_order_relaxed);
+    });
+  }
+
+  auto max_bytes = config->flush_max_buffered_bytes;
+  if (urgent || (max_bytes > 0 && state.pending_bytes >= max_bytes)) {
+    flush_sinks();
+  }
+}
+
+// Coalesces consecutive repeats of a record from one call site: same
+// message, within the window since the last one let through. The first is
+// written, the rest are counted and later replaced by one "last message
+// repeated N times" record, written when the site logs something else, when
+// the window has passed, or on flush(). Sites share a fixed table; a
+// collision just ends a run early.
+// Guarded by output_mutex().
+class Deduplicator {
+public:
+  static Deduplicator &instance() {
+    static Deduplicator instance;
+    return instance;
+  }
+
+  ~Deduplicator() {
+    std::lock_guard<std::mutex> lock(output_mutex());
+    expire(std::chrono::system_clock::now(), true);
+  }
+
+  void write(const RecordView *records, std::size_t count,
+             std::chrono::milliseconds window) {
+    if (pending_ > 0 && records[0].time >= next_expiry_) {
+      expire(records[0].time);
+    }
+    // Runs of records that pass are delivered in one call
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto &record = records[i];
+      auto body = record.message.empty() && record.text.empty() ? record.args
+                                                                : record.message;
+      auto hash = std::hash<std::string_view>{}(body);
+      auto &entry = table_[(reinterpret_cast<std::uintptr_t>(record.site) >> 4) &
+                           (kTableSize - 1)];
+      if (entry.site == record.site && entry.hash == hash &&
+          entry.logger == record.logger && record.time - entry.start < window) {
+        if (entry.repeats++ == 0) {
+          ++pending_;
+          next_expiry_ = std::min(next_expiry_, entry.start + window);
+        }
+        deliver_to_sinks(records + run, i - run);
+        run = i + 1;
+        continue;
+      }
+      if (entry.repeats > 0) {
+        deliver_to_sinks(records + run, i - run);
+        run = i;
+        summarise(entry, record.time);
+      }
+      entry.site = record.site;
+      entry.logger = record.logger;
+      entry.hash = hash;
+      entry.start = record.time;
+      entry.level = record.level;
+      entry.file = record.file;
+      entry.line = record.line;
+      entry.thread.assign(record.thread);
+      entry.window = window;
+    }
+    deliver_to_sinks(records + run, count - run);
+  }
+
+  // Writes the summaries of runs whose window has ended by `now`, or of
+  // every run
+  void expire(std::chrono::system_clock::time_point now, bool all = false) {
+    if (pending_ == 0) {
+      return;
+    }
+    next_expiry_ = std::chrono::system_clock::time_point::max();
+    for (auto &entry : table_) {
+      if (entry.repeats == 0) {
+        continue;
+      }
+      if (all || now - entry.start >= entry.window) {
+        summarise(entry, now);
+        entry.site = nullptr;
+      } else {
+        next_expiry_ = std::min(next_expiry_, entry.start + entry.window);
+      }
+    }
+  }
+
+private:
+  static constexpr std::size_t kTableSize = 256;
+
+  struct Entry {
+    const void *site = nullptr;
+    const Logger *logger = nullptr;
+    std::size_t hash = 0;
+    std::chrono::system_clock::time_point start;
+    std::chrono::milliseconds window{0};
+    std::uint64_t repeats = 0;
+    Level level = Level::INFO;
+    std::string_view file;
+    int line = 0;
+    ThreadTag thread;
+  };
+
+  Deduplicator() {
+    // Construct what the destructor uses first, so it is destroyed after us
+    State::instance();
+    output_mutex();
+    default_sink();
+    LoggerRegistry::instance();
+    Layouts::instance();
+    FileWorker::instance();
+  }
+
+  void summarise(Entry &entry, std::chrono::system_clock::time_point time) {
+    auto repeats = std::exchange(entry.repeats, 0);
+    --pending_;
+    line_.clear();
+    State::Hold config;
+    auto message = format_line(
+        line_, line_format(*config),
+        LoggerRegistry::options(*config, entry.logger), entry.level, time,
+        entry.thread.view(), entry.file, entry.line,
+        [&] {
+          line_.append("last message repeated ");
+          line_.append_integer(repeats);
+          line_.append(" times");
+        },
+        [] {});
+    std::string_view text = line_.view();
+    RecordView view{entry.level,
+                    time,
+                    entry.thread.view(),
+                    entry.file,
+                    entry.line,
+                    text.substr(message.begin, message.end - message.begin),
+                    text,
+                    entry.site,
+                    {},
+                    {},
+                    entry.logger};
+    deliver_to_sinks(&view, 1);
+  }
+
+  std::array<Entry, kTableSize> table_;
+  std::size_t pending_ = 0; // Entries with repeats
+  std::chrono::system_clock::time_point next_expiry_ =
+      std::chrono::system_clock::time_point::max();
+  LineBuffer line_;
+};
+
+// Writes a batch through duplicate suppression, if enabled. Caller must hold
+// output_mutex().
+inline void write_to_sinks(const RecordView *records, std::size_t count) {
+  auto window = State::Hold()->duplicate_window_ms;
+  if (window > 0 && count > 0) {
+    Deduplicator::instance().write(records, count,
+                                   std::chrono::milliseconds(window));
+  } else {
+    deliver_to_sinks(records, count);
+  }
+}
+
+// Writes every pending "repeated" summary. Caller must hold output_mutex().
+inline void flush_repeats(bool force = false) {
+  if (force || State::Hold()->duplicate_window_ms > 0) {
+    Deduplicator::instance().expire(std::chrono::system_clock::now(), true);
+  }
+}
+
+// Background thread for the periodic part of the FlushPolicy
+class FlushTimer {
+public:
+  static FlushTimer &instance() {
+    static FlushTimer instance;
+    return instance;
+  }
+
+  ~FlushTimer() { stop(); }
+
+  void start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!worker_.joinable()) {
+      stop_requested_ = false;
+      worker_ = std::thread([this] { run(); });
+    } else {
+      cv_.notify_one(); // Pick up the new interval
+    }
+  }
+
+  void stop() {
+    std::thread worker;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_requested_ = true;
+      worker = std::move(worker_);
+    }
+    cv_.notify_one();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+private:
+  FlushTimer() {
+    // Construct what run() uses first, so it is destroyed after us
+    output_mutex();
+    default_sink();
+  }
+
+  void run() {
+    auto &state = State::instance();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_requested_) {
+      auto interval =
+          std::chrono::milliseconds(State::Hold()->flush_interval_ms);
+      if (interval.count() <= 0) {
+        cv_.wait(lock);
+        continue;
+      }
+      if (cv_.wait_for(lock, interval) == std::cv_status::no_timeout) {
+        continue;
+      }
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> output_lock(output_mutex());
+        if (state.pending_bytes > 0) {
+          flush_sinks();
+        }
+      }
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_requested_ = false;
+  std::thread worker_;
+};
+
+// Bounded lock-free single-producer/single-consumer ring buffer. Each cell
+// carries a sequence number telling the producer and the consumer whether it
+// is free or published, so neither side reads the other's index. The
+// producer may also discard the oldest cell, so the head is claimed with a
+// CAS. Positions start at `base`, letting a chain of queues continue one
+// numbering. Cells are allocated a block at a time when the producer first
+// reaches them, so a queue that never fills stays small.
+template <typename T> class SpscQueue {
+public:
+  static constexpr std::size_t kBlockSize = 64;
+
+  explicit SpscQueue(std::size_t capacity, std::size_t base = 0)
+      : base_(base), tail_(base), head_(base) {
+    std::size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask_ = size - 1;
+    block_size_ = std::min(size, kBlockSize);
+    blocks_ = std::make_unique<std::atomic<Cell *>[]>(size / block_size_);
+  }
+
+  ~SpscQueue() {
+    for (std::size_t i = 0; i < (mask_ + 1) / block_size_; ++i) {
+      delete[] blocks_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  std::size_t capacity() const { return mask_ + 1; }
+
+  // Lets `fill` write the next free cell. Returns false if full. Single
+  // producer only.
+  template <typename Fill> bool try_push(Fill &&fill) {
+    std::size_t index = tail_ & mask_;
+    Cell *block = blocks_[index / block_size_].load(std::memory_order_relaxed);
+    if (!block) {
+      block = allocate(index / block_size_);
+    }
+    Cell &cell = block[index % block_size_];
+    if (cell.sequence.load(std::memory_order_acquire) != tail_) {
+      return false;
+    }
+    fill(cell.value);
+    cell.sequence.store(tail_ + 1, std::memory_order_release);
+    ++tail_;
+    return true;
+  }
+
+  // Position the next push will take. Producer only.
+  std::size_t end() const { return tail_; }
+
+  // Hands the oldest published cell to `drain`. Called by the consumer, and
+  // by the producer to discard.
+  template <typename Drain> bool try_pop(Drain &&drain) {
+    std::size_t pos = head_.load(std::memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+      cell = find(pos);
+      if (!cell) {
+        return false;
+      }
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) -
+                  static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    drain(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Position of the oldest cell
+  std::size_t position() const {
+    return head_.load(std::memory_order_relaxed);
+  }
+
+  bool empty() const {
+    std::size_t head = position();
+    const Cell *cell = find(head);
+    return !cell ||
+           cell->sequence.load(std::memory_order_acquire) != head + 1;
+  }
+
+  // Number of cells ready to pop; walks the queue
+  std::size_t published() const {
+    std::size_t head = position();
+    std::size_t count = 0;
+    while (count <= mask_) {
+      const Cell *cell = find(head + count);
+      if (!cell || cell->sequence.load(std::memory_order_acquire) !=
+                       head + count + 1) {
+        break;
+      }
+      ++count;
+    }
+    return count;
+  }
+
+private:
+  struct Cell {
+    std::atomic<std::size_t> sequence{0};
+    T value;
+  };
+
+  // The cell for `pos`, or null if its block has not been reached yet, in
+  // which case nothing is published there
+  Cell *find(std::size_t pos) const {
+    std::size_t index = pos & mask_;
+    Cell *block = blocks_[index / block_size_].load(std::memory_order_acquire);
+    return block ? &block[index % block_size_] : nullptr;
+  }
+
+  // Producer only. Each cell starts free for the first position that maps
+  // to it.
+  Cell *allocate(std::size_t block_index) {
+    auto *block = new Cell[block_size_];
+    for (std::size_t i = 0; i < block_size_; ++i) {
+      std::size_t index = block_index * block_size_ + i;
+      block[i].sequence.store(base_ + ((index - base_) & mask_),
+                              std::memory_order_relaxed);
+    }
+    blocks_[block_index].store(block, std::memory_order_release);
+    return block;
+  }
+
+  std::unique_ptr<std::atomic<Cell *>[]> blocks_;
+  std::size_t mask_ = 0;
+  std::size_t block_size_ = 0;
+  std::size_t base_;
+  alignas(kCacheLine) std::size_t tail_;
+  alignas(kCacheLine) std::atomic<std::size_t> head_;
+};
+
+// Blocks a flush() caller until the backend has written everything before it
+struct FlushRequest {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::size_t pending = 1; // Shards yet to answer
+  bool done = false;
+};
+
+// One line of a logging::Batch record, whose data holds the lines end to end
+struct BatchLine {
+  Level level = Level::INFO;
+  const void *site = nullptr;
+  std::string_view file;
+  int line = 0;
+  std::size_t end = 0; // Of the line's text within the data
+  MessageSpan message; // Within the line's text
+};
+
+// Lines of a Batch per level
+using LineCounts = std::array<std::uint32_t, kLevelCount>;
+
+struct Record {
+  Level level = Level::INFO;
+  // Set for deferred records, whose data holds encoded arguments
+  DecodeFn decode = nullptr;
+  const void *site = nullptr;
+  const Logger *logger = nullptr;
+  std::string_view pattern;
+  std::string_view file;
+  int line = 0;
+  std::chrono::system_clock::time_point time;
+  ThreadTag thread;
+  // Formatted line, or the encoded arguments of a deferred record
+  std::string data;
+  LazyArgs lazy_args; // Referenced from `data`
+  MessageSpan message;
+  // Set for a published Batch; cleared once written
+  std::vector<BatchLine> batch;
+  FlushRequest *flush = nullptr;
+  // How a deferred record is formatted, as of its call
+  OutputFormat format = OutputFormat::Text;
+  TimestampPrecision precision = TimestampPrecision::Milliseconds;
+  LineOptions options = {};
+  std::shared_ptr<const Layout> layout; // Text only
+
+  LineFormat line_format() const {
+    return {format, precision, layout.get()};
+  }
+
+  // Empties a reused queue slot, keeping its buffers' capacity
+  void reset() {
+    level = Level::INFO;
+    decode = nullptr;
+    site = nullptr;
+    logger = nullptr;
+    pattern = {};
+    file = {};
+    line = 0;
+    time = {};
+    thread = {};
+    data.clear();
+    lazy_args.clear();
+    message = {};
+    batch.clear();
+    flush = nullptr;
+    layout.reset();
+  }
+};
+
+// A producer thread's queue, owned by the backend. Registered on the
+// thread's first async log call; reclaimed once the thread has exited and
+// the backend has drained it. Normally a single segment of `capacity`
+// records, whose memory is allocated as it first fills; the Grow overflow
+// policy chains more, which the consumer frees as it moves past them.
+struct ThreadQueue {
+  struct Segment {
+    Segment(std::size_t capacity, std::size_t base) : queue(capacity, base) {}
+
+    SpscQueue<Record> queue;
+    std::atomic<Segment *> next{nullptr};
+  };
+
+  explicit ThreadQueue(std::size_t capacity)
+      : head(new Segment(capacity, 0)), tail(head) {}
+
+  ~ThreadQueue() {
+    while (head) {
+      delete std::exchange(head, head->next.load(std::memory_order_relaxed));
+    }
+  }
+
+  ThreadQueue(const ThreadQueue &) = delete;
+  ThreadQueue &operator=(const ThreadQueue &) = delete;
+
+  // Producer side
+  template <typename Fill> bool try_push(Fill &&fill) {
+    return tail->queue.try_push(fill);
+  }
+
+  // Continues the numbering, so positions stay comparable across segments
+  void grow() {
+    auto *segment = new Segment(tail->queue.capacity(), tail->queue.end());
+    tail->next.store(segment, std::memory_order_release);
+    tail = segment;
+  }
+
+  // Discards the oldest record of the newest segment, freeing a slot there
+  // without allocating. Older segments exist only because Grow records
+  // overflowed, and are kept. A flush marker is moved to the back instead,
+  // which only makes its flush wait longer.
+  void drop_oldest() {
+    FlushRequest *flush = nullptr;
+    auto discard = [&](Record &record) {
+      // A Batch record counts as its lines
+      if (!record.flush && record.batch.empty()) {
+        bump(dropped[static_cast<std::size_t>(record.level)]);
+      }
+      for (const auto &line : record.batch) {
+        bump(dropped[static_cast<std::size_t>(line.level)]);
+      }
+      flush = record.flush;
+      record.reset();
+    };
+    // Fails only if the consumer took it first, which frees the slot too
+    if (tail->queue.try_pop(discard) && flush) {
+      tail->queue.try_push([&](Record &record) {
+        record.reset();
+        record.flush = flush;
+      });
+    }
+  }
+
+  // Consumer side: pops from the oldest segment, moving on once the
+  // producer has left it and it is empty
+  template <typename Drain> bool try_pop(Drain &&drain) {
+    while (true) {
+      if (head->queue.try_pop(drain)) {
+        return true;
+      }
+      auto *next = head->next.load(std::memory_order_acquire);
+      if (!next) {
+        return false;
+      }
+      // The producer no longer touches a segment with a successor
+      if (head->queue.empty()) {
+        delete std::exchange(head, next);
+      }
+    }
+  }
+
+  // Pops everything left without freeing segments or locking. Crash
+  // handler only.
+  template <typename Drain> void emergency_drain(Drain &&drain) {
+    for (auto *segment = head; segment;
+         segment = segment->next.load(std::memory_order_acquire)) {
+      while (segment->queue.try_pop(drain)) {
+      }
+    }
+  }
+
+  bool empty() const {
+    return head->queue.empty() &&
+           !head->next.load(std::memory_order_acquire);
+  }
+
+  std::size_t position() const { return head->queue.position(); }
+
+  // Position just past the last published record
+  std::size_t published_end() const {
+    std::size_t end = position();
+    for (auto *segment = head; segment;
+         segment = segment->next.load(std::memory_order_acquire)) {
+      end = std::max(end, segment->queue.position() +
+                              segment->queue.published());
+    }
+    return end;
+  }
+
+  // Records queued and not yet popped, as far as the consumer can tell
+  std::size_t depth() const {
+    std::size_t tail_end = end.load(std::memory_order_relaxed);
+    std::size_t head = position();
+    return tail_end > head ? tail_end - head : 0;
+  }
+
+  // Single-writer counter; cheaper than an atomic add
+  static void bump(std::atomic<std::uint64_t> &counter, std::uint64_t by = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + by,
+                  std::memory_order_relaxed);
+  }
+
+  template <typename Totals> void add_to(Totals &totals) const {
+    for (std::size_t i = 0; i < kLevelCount; ++i) {
+      totals.enqueued[i] += enqueued[i].load(std::memory_order_relaxed);
+      totals.dropped[i] += dropped[i].load(std::memory_order_relaxed);
+    }
+    totals.blocked_ns += blocked_ns.load(std::memory_order_relaxed);
+  }
+
+  // Backend side
+  Segment *head;
+  ThreadQueue *next = nullptr;
+  std::uint8_t shard = 0; // Backend shard whose list holds this queue
+  // How far pending flushes need this queue drained
+  std::size_t flush_target = 0;
+
+  // Written by the producer on every push, so on lines of their own: the
+  // newest segment, the position after its last push, and counters indexed
+  // by level
+  alignas(kCacheLine) Segment *tail;
+  std::atomic<bool> retired{false};
+  std::atomic<std::size_t> end{0};
+  std::atomic<std::uint64_t> enqueued[kLevelCount] = {};
+  std::atomic<std::uint64_t> dropped[kLevelCount] = {};
+  std::atomic<std::uint64_t> blocked_ns{0};
+};
+
+// CPU ranges as the kernel prints them, e.g. "0-3,8,10-11"
+inline std::vector<int> parse_cpu_list(std::string_view text) {
+  std::vector<int> cpus;
+  const char *pos = text.data();
+  const char *end = pos + text.size();
+  while (pos < end) {
+    int first = 0;
+    auto result = std::from_chars(pos, end, first);
+    if (result.ec != std::errc()) {
+      break;
+    }
+    int last = first;
+    pos = result.ptr;
+    if (pos < end && *pos == '-') {
+      result = std::from_chars(pos + 1, end, last);
+      if (result.ec != std::errc()) {
+        break;
+      }
+      pos = result.ptr;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    if (pos < end && *pos != ',') {
+      break;
+    }
+    ++pos;
+  }
+  return cpus;
+}
+
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+// The NUMA nodes that have CPUs, from sysfs; empty where unknown
+inline std::vector<NumaNode> numa_nodes() {
+  std::vector<NumaNode> nodes;
+#if defined(__linux__)
+  auto read = [](const std::string &path) {
+    std::string text;
+    if (auto *file = std::fopen(path.c_str(), "r")) {
+      char buffer[4096];
+      auto n = std::fread(buffer, 1, sizeof(buffer), file);
+      text.assign(buffer, n);
+      std::fclose(file);
+    }
+    return text;
+  };
+  std::string root = "/sys/devices/system/node/";
+  for (int id : parse_cpu_list(read(root + "online"))) {
+    auto cpus =
+        parse_cpu_list(read(root + "node" + std::to_string(id) + "/cpulist"));
+    if (!cpus.empty()) {
+      nodes.push_back({id, std::move(cpus)});
+    }
+  }
+#endif
+  return nodes;
+}
+
+// NUMA node of the CPU the calling thread is running on, or -1
+inline int current_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return static_cast<int>(node);
+  }
+#endif
+  return -1;
+}
+
+// Restricts the calling thread to `cpus`; Linux only, ignored elsewhere
+inline void pin_current_thread(const std::vector<int> &cpus) {
+#if defined(__linux__)
+  if (cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  ::sched_setaffinity(0, sizeof(set), &set);
+#else
+  (void)cpus;
+#endif
+}
+
+// Spin-wait hint to the CPU
+inline void cpu_relax() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_ia32_pause();
+#elif defined(__GNUC__) && defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// One encoded argument without anything a signal handler may not call:
+// lazy arguments, which run user code, are left out
+inline void append_raw_arg(const char *&pos, LineBuffer &out) {
+  auto type = static_cast<ArgType>(*pos);
+  if (type == ArgType::Lazy) {
+    ++pos;
+    get_raw<const LazyArg *>(pos);
+    out.append("<lazy>");
+#if !defined(__cpp_lib_to_chars) || __cpp_lib_to_chars < 201611L
+  } else if (type == ArgType::Double) {
+    ++pos; // append_float() would fall back to snprintf
+    get_raw<double>(pos);
+    out.append("<double>");
+#endif
+  } else {
+    decode_arg(pos, out);
+  }
+}
+
+// Async-signal-safe stand-in for format_line(), used by the crash handler
+// for deferred records: the time is raw epoch nanoseconds, as formatting it
+// takes the time zone lock, and `{}` placeholders are filled in plainly
+inline void format_raw(const Record &record, LineBuffer &out) {
+  const char *pos = record.data.data();
+  const char *end = pos + record.data.size();
+  out.append('[');
+  out.append_integer(static_cast<long long>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          record.time.time_since_epoch())
+          .count()));
+  out.append("] [");
+  out.append(get_level_name(record.level));
+  out.append("] ");
+  auto is_key = [&] { return static_cast<ArgType>(*pos) == ArgType::Key; };
+  auto &pattern = record.pattern;
+  for (std::size_t i = 0; i < pattern.size(); ++i) {
+    char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+    if (pattern[i] == '{' && next == '}') {
+      if (pos < end && !is_key()) {
+        append_raw_arg(pos, out);
+      }
+      ++i;
+      continue;
+    }
+    if ((pattern[i] == '{' && next == '{') ||
+        (pattern[i] == '}' && next == '}')) {
+      ++i;
+    }
+    out.append(pattern[i]);
+  }
+  while (pos < end && !is_key()) {
+    append_raw_arg(pos, out);
+  }
+  while (pos < end) {
+    out.append(' ');
+    decode_arg(pos, out); // The key
+    out.append('=');
+    if (pos < end) {
+      append_raw_arg(pos, out);
+    }
+  }
+  out.append(" (");
+  out.append(record.file);
+  out.append(':');
+  out.append_integer(record.line);
+  out.finish(")\n");
+}
+
+#if LOGGING_POSIX
+// The calling thread's alternate signal stack, so that a stack overflow
+// still reaches the crash handler. Set up once the handler is installed,
+// on a thread's first async log call, and freed when the thread exits. A
+// thread that already has one keeps it.
+class SignalStack {
+public:
+  static void enable() {
+    enabled().store(true, std::memory_order_release);
+    attach();
+  }
+
+  static void attach() {
+    if (enabled().load(std::memory_order_acquire)) {
+      thread_local SignalStack stack;
+    }
+  }
+
+  SignalStack(const SignalStack &) = delete;
+  SignalStack &operator=(const SignalStack &) = delete;
+
+private:
+  static constexpr std::size_t kSize = 64 * 1024;
+
+  static std::atomic<bool> &enabled() {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+  }
+
+  SignalStack() {
+    stack_t current{};
+    if (::sigaltstack(nullptr, &current) == 0 &&
+        !(current.ss_flags & SS_DISABLE)) {
+      return;
+    }
+    memory_ = std::make_unique<char[]>(kSize);
+    stack_t stack{};
+    stack.ss_sp = memory_.get();
+    stack.ss_size = kSize;
+    if (::sigaltstack(&stack, nullptr) != 0) {
+      memory_.reset();
+    }
+  }
+
+  ~SignalStack() {
+    if (memory_) {
+      stack_t stack{};
+      stack.ss_flags = SS_DISABLE;
+      ::sigaltstack(&stack, nullptr);
+    }
+  }
+
+  std::unique_ptr<char[]> memory_;
+};
+#endif
+
+// Background writer draining every thread's queue to the sinks in batches,
+// merged in timestamp order. With AsyncOptions::per_numa_node there is one
+// writer (shard) per node, each draining the queues of threads that first
+// logged on that node; batches from different shards reach the sinks in
+// turn, so order across them is only as close as their timestamps allow.
+class AsyncBackend {
+public:
+  static constexpr std::size_t kDefaultCapacity = 8192;
+  static constexpr std::size_t kMaxShards = 8;
+
+  static AsyncBackend &instance() {
+    static AsyncBackend instance;
+    return instance;
+  }
+
+  ~AsyncBackend() {
+    stop();
+    for (auto &shard : shards_) {
+      auto *queue = shard.queues.load(std::memory_order_acquire);
+      while (queue) {
+        delete std::exchange(queue, queue->next);
+      }
+    }
+  }
+
+  bool running() const { return running_.load(std::memory_order_acquire); }
+
+  // The queue capacity is per producer thread. Threads pick up a larger
+  // capacity on their next log call; they keep the shard they started on.
+  void start(const AsyncOptions &options) {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (running()) {
+      return;
+    }
+    auto capacity = options.queue_capacity;
+    if (capacity > capacity_.load(std::memory_order_relaxed)) {
+      capacity_.store(capacity, std::memory_order_relaxed);
+      generation_.fetch_add(1, std::memory_order_release);
+    }
+    configure_shards(options);
+    idle_.store(options.idle, std::memory_order_relaxed);
+    max_sleep_.store(std::max(options.max_sleep, std::chrono::milliseconds(1)),
+                     std::memory_order_relaxed);
+    stop_requested_.store(false, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < active_shards(); ++i) {
+      shards_[i].worker = std::thread([this, i] { run(i); });
+    }
+    running_.store(true, std::memory_order_release);
+  }
+
+  // A producer that checked running() before this call may still push. Its
+  // queue end and our flag are both seq_cst, so either the final drain
+  // reaches its record or push() sees the flag cleared and drains it.
+  void stop() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (!running_.exchange(false)) {
+      return;
+    }
+    stop_requested_.store(true, std::memory_order_release);
+    for (std::size_t i = 0; i < active_shards(); ++i) {
+      shards_[i].wake_cv.notify_one();
+      shards_[i].worker.join();
+    }
+    // Pick up anything pushed while the workers were exiting
+    while (drain_all() > 0 || !drained()) {
+    }
+  }
+
+  // Backend threads started by the last start()
+  std::size_t active_shards() const {
+    return active_shards_.load(std::memory_order_relaxed);
+  }
+
+  // Enqueues a record of `level`, written by `fill`, applying `policy` if
+  // this thread's queue is full. Returns false if the thread is exiting and
+  // has no queue. A Batch record passes its `lines` per level, which the
+  // counters count instead.
+  template <typename Fill>
+  bool push(Level level, OverflowPolicy policy, Fill &&fill,
+            const LineCounts *lines = nullptr) {
+    auto *queue = producer_queue();
+    if (!queue) {
+      return false;
+    }
+    bool queued = enqueue(queue, policy, fill);
+    auto &counters = queued ? queue->enqueued : queue->dropped;
+    // stop() may have finished draining since we checked; see there
+    if (!running_.load(std::memory_order_seq_cst)) {
+      drain_if_stopped();
+    }
+    if (!lines) {
+      ThreadQueue::bump(counters[static_cast<std::size_t>(level)]);
+    } else {
+      for (std::size_t i = 0; i < kLevelCount; ++i) {
+        if ((*lines)[i] > 0) {
+          ThreadQueue::bump(counters[i], (*lines)[i]);
+        }
+      }
+    }
+    if (!queued) {
+      drops_pending_.store(true, std::memory_order_release);
+    }
+    return true;
+  }
+
+  // Totals over every producer thread, including exited ones
+  struct Totals {
+    std::array<std::uint64_t, kLevelCount> enqueued = {};
+    std::array<std::uint64_t, kLevelCount> dropped = {};
+    std::uint64_t blocked_ns = 0;
+  };
+
+  Totals totals() {
+    std::lock_guard<std::mutex> lock(reclaim_mutex_);
+    return totals_locked();
+  }
+
+  // Sampled by the backend on each pass
+  std::size_t depth() const {
+    std::size_t depth = 0;
+    for (const auto &shard : shards_) {
+      depth += shard.depth.load(std::memory_order_relaxed);
+    }
+    return depth;
+  }
+  std::size_t high_water() const {
+    return high_water_.load(std::memory_order_relaxed);
+  }
+
+  // Time from log call to sink write, over every record written by the
+  // backend
+  std::uint64_t latency_total_ns() const {
+    return latency_total_ns_.load(std::memory_order_relaxed);
+  }
+  std::uint64_t latency_max_ns() const {
+    return latency_max_ns_.load(std::memory_order_relaxed);
+  }
+  std::uint64_t latency_records() const {
+    return latency_records_.load(std::memory_order_relaxed);
+  }
+
+  // Waits until every record enqueued before the call has been written. The
+  // marker goes through this thread's queue; other shards are asked
+  // directly and answer once they have drained what they had published.
+  void flush() {
+    FlushRequest request;
+    auto *queue = producer_queue();
+    if (!queue) {
+      return;
+    }
+    auto shards = active_shards();
+    auto own = queue->shard % shards;
+    request.pending = shards;
+    for (std::size_t i = 0; i < shards; ++i) {
+      if (i != own) {
+        post(shards_[i], &request);
+      }
+    }
+    enqueue(queue, OverflowPolicy::Block, [&](Record &record) {
+      record.reset();
+      record.flush = &request;
+    });
+    std::unique_lock<std::mutex> lock(request.mutex);
+    while (!request.cv.wait_for(lock, std::chrono::milliseconds(10),
+                                [&] { return request.done; })) {
+      // The backend may have stopped after we pushed the marker
+      lock.unlock();
+      drain_if_stopped();
+      lock.lock();
+    }
+  }
+
+#if LOGGING_POSIX
+  // Crash handler only: stops the worker taking new records and gives its
+  // current batch up to 100ms to reach the sinks
+  void halt() {
+    halted_.store(true);
+    for (const auto &shard : shards_) {
+      if (std::this_thread::get_id() == shard.worker.get_id()) {
+        return;
+      }
+    }
+    for (const auto &shard : shards_) {
+      for (int i = 0; i < 100 && shard.busy.load(); ++i) {
+        timespec delay{0, 1000000};
+        ::nanosleep(&delay, nullptr);
+      }
+    }
+  }
+#endif
+
+  // Crash handler only: pops whatever is still queued, one thread's queue
+  // after another, without locking and passes each line to `write` along
+  // with its logger. Deferred records are written in raw form, built in
+  // `line`.
+  template <typename Write>
+  void emergency_drain(LineBuffer &line, Write &&write) {
+    for_each_queue([&](ThreadQueue *queue) {
+      queue->emergency_drain([&](Record &record) {
+        if (record.flush) {
+          return;
+        }
+        if (!record.decode) {
+          write(record.logger, std::string_view(record.data));
+          return;
+        }
+        line.clear();
+        format_raw(record, line);
+        write(record.logger, line.view());
+      });
+    });
+  }
+
+private:
+  static constexpr std::size_t kMaxBatch = 1024;
+  static constexpr std::size_t kMaxNodes = 64;
+  // Empty passes the Sleep strategy spins, then yields, before blocking
+  static constexpr unsigned kSpinPasses = 64;
+  static constexpr unsigned kYieldPasses = 16;
+  static constexpr std::chrono::seconds kDropReportInterval{1};
+
+  // A drained record plus the line formatted from it
+  struct Entry {
+    Record record;
+    std::string text;
+  };
+
+  // One backend thread's state. Shard i drains the queue lists of shards
+  // i, i + active_shards(), ..., so lists left by a wider configuration are
+  // still drained after a restart with fewer shards.
+  struct Shard {
+    // Producer threads' queues, newest first
+    std::atomic<ThreadQueue *> queues{nullptr};
+    std::vector<Entry> entries;
+    // Drained entries in timestamp order
+    std::vector<std::uint32_t> order;
+    std::vector<RecordView> views;
+    std::vector<FlushRequest *> flush_requests;
+    // Flushes asked for by other shards' producers, under wake_mutex
+    std::vector<FlushRequest *> posted;
+    std::atomic<bool> has_posted{false};
+    std::vector<int> cpus; // Empty if unpinned
+    std::thread worker;
+    // Set while the worker holds popped records
+    std::atomic<bool> busy{false};
+    std::atomic<std::size_t> depth{0};
+    // Read by producers on every push, so apart from what the worker writes
+    // on every pass
+    alignas(kCacheLine) std::atomic<bool> sleeping{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake_cv;
+
+    // Done by the worker once pinned, so the memory is local to its node
+    void allocate() {
+      if (entries.empty()) {
+        entries.resize(kMaxBatch);
+        order.resize(kMaxBatch);
+        views.reserve(kMaxBatch);
+        flush_requests.reserve(64);
+      }
+    }
+  };
+
+  // The calling thread's queue. Retired when the thread exits.
+  struct Producer {
+    ThreadQueue *queue = nullptr;
+    std::uint64_t generation = 0;
+    bool exited = false;
+
+    ~Producer() {
+      exited = true;
+      if (queue) {
+        queue->retired.store(true, std::memory_order_release);
+      }
+    }
+  };
+
+  AsyncBackend() {
+    // Construct what stop() uses at exit first, so it is destroyed after us
+    output_mutex();
+    default_sink();
+    LoggerRegistry::instance();
+    Layouts::instance();
+    Deduplicator::instance();
+    FileWorker::instance();
+  }
+
+  ThreadQueue *producer_queue() {
+    thread_local Producer producer;
+    auto generation = generation_.load(std::memory_order_acquire);
+    if (producer.queue && producer.generation == generation) {
+      return producer.queue;
+    }
+    if (producer.exited) {
+      return nullptr;
+    }
+    // First call on this thread, or the capacity grew
+    if (producer.queue) {
+      producer.queue->retired.store(true, std::memory_order_release);
+    }
+    // Allocated and first touched here, so it is local to this thread's node
+    auto *queue = new ThreadQueue(capacity_.load(std::memory_order_relaxed));
+    int node = current_numa_node();
+    if (node >= 0 && static_cast<std::size_t>(node) < kMaxNodes) {
+      queue->shard = node_shard_[node].load(std::memory_order_relaxed);
+    }
+    auto &queues = shards_[queue->shard].queues;
+    queue->next = queues.load(std::memory_order_relaxed);
+    while (!queues.compare_exchange_weak(queue->next, queue,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+    producer.queue = queue;
+    producer.generation = generation;
+#if LOGGING_POSIX
+    SignalStack::attach();
+#endif
+    return queue;
+  }
+
+  // One shard per NUMA node that has allowed CPUs, or a single one. Threads
+  // on nodes without a shard of their own go to shard 0.
+  void configure_shards(const AsyncOptions &options) {
+    std::vector<std::vector<int>> cpus;
+    for (auto &entry : node_shard_) {
+      entry.store(0, std::memory_order_relaxed);
+    }
+    if (options.per_numa_node) {
+      for (const auto &node : numa_nodes()) {
+        std::vector<int> allowed;
+        for (int cpu : node.cpus) {
+          if (options.cpus.empty() ||
+              std::find(options.cpus.begin(), options.cpus.end(), cpu) !=
+                  options.cpus.end()) {
+            allowed.push_back(cpu);
+          }
+        }
+        if (allowed.empty() || cpus.size() == kMaxShards) {
+          continue;
+        }
+        if (static_cast<std::size_t>(node.id) < kMaxNodes) {
+          node_shard_[node.id].store(static_cast<std::uint8_t>(cpus.size()),
+                                     std::memory_order_relaxed);
+        }
+        cpus.push_back(std::move(allowed));
+      }
+    }
+    if (cpus.empty()) {
+      cpus.push_back(options.cpus);
+    }
+    for (std::size_t i = 0; i < cpus.size(); ++i) {
+      shards_[i].cpus = std::move(cpus[i]);
+    }
+    active_shards_.store(cpus.size(), std::memory_order_relaxed);
+  }
+
+  // Visits the queues of every shard list, active or not
+  template <typename F> void for_each_queue(F &&fn) {
+    for (auto &shard : shards_) {
+      for (auto *queue = shard.queues.load(std::memory_order_acquire); queue;
+           queue = queue->next) {
+        fn(queue);
+      }
+    }
+  }
+
+  std::size_t drain_all() {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < active_shards(); ++i) {
+      count += drain(i);
+    }
+    return count;
+  }
+
+  // Whether every queue has been drained up to its producer's last push
+  bool drained() {
+    bool drained = true;
+    for_each_queue([&](ThreadQueue *queue) {
+      drained = drained && queue->position() >=
+                               queue->end.load(std::memory_order_seq_cst);
+    });
+    return drained;
+  }
+
+  void drain_if_stopped() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (!running()) {
+      while (drain_all() > 0) {
+      }
+    }
+  }
+
+  void post(Shard &shard, FlushRequest *request) {
+    {
+      std::lock_guard<std::mutex> lock(shard.wake_mutex);
+      shard.posted.push_back(request);
+      shard.has_posted.store(true, std::memory_order_release);
+    }
+    shard.wake_cv.notify_one();
+  }
+
+  // After a push, whose seq_cst store of the queue end pairs with run().
+  // Taking the mutex means the worker is waiting by the time we notify.
+  void wake(const ThreadQueue *queue) {
+    auto &shard = shards_[queue->shard % active_shards()];
+    if (shard.sleeping.load() &&
+        shard.sleeping.exchange(false, std::memory_order_relaxed)) {
+      { std::lock_guard<std::mutex> lock(shard.wake_mutex); }
+      shard.wake_cv.notify_one();
+    }
+  }
+
+  void run(std::size_t index) {
+    auto &shard = shards_[index];
+    pin_current_thread(shard.cpus);
+    shard.allocate();
+    auto idle = idle_.load(std::memory_order_relaxed);
+    auto max_sleep = max_sleep_.load(std::memory_order_relaxed);
+    std::chrono::milliseconds sleep{1};
+    unsigned idle_passes = 0;
+    while (true) {
+      bool stopping = stop_requested_.load(std::memory_order_acquire);
+      if (drain(index) > 0) {
+        idle_passes = 0;
+        sleep = std::chrono::milliseconds(1);
+        continue;
+      }
+      if (stopping) {
+        break;
+      }
+      ++idle_passes;
+      if (idle == IdleStrategy::Spin ||
+          (idle == IdleStrategy::Sleep && idle_passes <= kSpinPasses)) {
+        cpu_relax();
+        continue;
+      }
+      if (idle == IdleStrategy::Yield ||
+          idle_passes <= kSpinPasses + kYieldPasses) {
+        std::this_thread::yield();
+        continue;
+      }
+      // Both this flag and the queue ends are seq_cst, so a producer
+      // either sees it set and wakes us, or pushed early enough for
+      // pending() to see it. Timed parts of the work bound the wait.
+      std::unique_lock<std::mutex> lock(shard.wake_mutex);
+      shard.sleeping.store(true);
+      if (!shard.has_posted.load(std::memory_order_relaxed) &&
+          !pending(index)) {
+        shard.wake_cv.wait_for(lock, std::min(sleep, next_timed_work(index)));
+        sleep = std::min(sleep * 2, max_sleep);
+      }
+      shard.sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  // Whether any queue of shard `index` holds records not yet drained
+  bool pending(std::size_t index) {
+    std::size_t shards = active_shards();
+    for (std::size_t list = index; list < kMaxShards; list += shards) {
+      for (auto *queue = shards_[list].queues.load(std::memory_order_acquire);
+           queue; queue = queue->next) {
+        if (queue->position() < queue->end.load(std::memory_order_seq_cst)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // How long until a drop report or a "repeated" summary may be due
+  std::chrono::milliseconds next_timed_work(std::size_t index) {
+    auto wait = std::chrono::milliseconds::max();
+    if (index == 0 && drops_pending_.load(std::memory_order_relaxed)) {
+      auto due = last_drop_report_ + kDropReportInterval -
+                 std::chrono::steady_clock::now();
+      wait = std::max(
+          std::chrono::ceil<std::chrono::milliseconds>(due),
+          std::chrono::milliseconds(1));
+    }
+    auto window = State::Hold()->duplicate_window_ms;
+    if (window > 0) {
+      wait = std::min(wait, std::chrono::milliseconds(window));
+    }
+    return wait;
+  }
+
+  // One pass over every queue of shard `index`, taking an equal share of a
+  // batch from each. Records are swapped out of the queues so their buffers
+  // circulate without allocating. A flush marker, or a request posted by
+  // another shard's producer, sets each queue a target of what it had
+  // published at that point; the request is answered once every queue has
+  // been drained that far.
+  std::size_t drain(std::size_t index) {
+    auto &shard = shards_[index];
+    shard.allocate();
+    auto &entries = shard.entries;
+    auto &flush_requests = shard.flush_requests;
+    std::size_t shards = active_shards();
+    std::size_t count = 0;
+    std::size_t sources = 0;
+    bool new_requests = false;
+    shard.busy.store(true);
+
+    if (shard.has_posted.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(shard.wake_mutex);
+      flush_requests.insert(flush_requests.end(), shard.posted.begin(),
+                            shard.posted.end());
+      shard.posted.clear();
+      shard.has_posted.store(false, std::memory_order_relaxed);
+      new_requests = true;
+    }
+
+    std::size_t queue_count = 0;
+    std::size_t high_water = 0;
+    for (std::size_t list = index; list < kMaxShards; list += shards) {
+      for (auto *queue = shards_[list].queues.load(std::memory_order_acquire);
+           queue; queue = queue->next) {
+        ++queue_count;
+        high_water = std::max(high_water, queue->depth());
+      }
+    }
+    store_max(high_water_, high_water);
+    std::size_t share =
+        std::max<std::size_t>(kMaxBatch / std::max<std::size_t>(queue_count, 1), 1);
+
+    for (std::size_t list = index; list < kMaxShards; list += shards) {
+      for (auto *queue = shards_[list].queues.load(std::memory_order_acquire);
+           queue; queue = queue->next) {
+        std::size_t first = count;
+        std::size_t taken = 0;
+        while (taken < share && count < kMaxBatch && !halted_.load() &&
+               queue->try_pop([&](Record &record) {
+                 if (record.flush) {
+                   flush_requests.push_back(record.flush);
+                   record.flush = nullptr;
+                   new_requests = true;
+                 } else {
+                   std::swap(entries[count++].record, record);
+                 }
+               })) {
+          ++taken;
+        }
+        if (count > first) {
+          ++sources;
+        }
+      }
+    }
+
+    auto &order = shard.order;
+    for (std::size_t i = 0; i < count; ++i) {
+      order[i] = static_cast<std::uint32_t>(i);
+    }
+    if (sources > 1) {
+      std::sort(order.begin(), order.begin() + static_cast<long>(count),
+                [&](std::uint32_t a, std::uint32_t b) {
+                  auto ta = entries[a].record.time;
+                  auto tb = entries[b].record.time;
+                  return ta < tb || (ta == tb && a < b);
+                });
+    }
+    dispatch(shard, count);
+    if (index == 0) {
+      report_drops();
+    }
+    if (State::Hold()->duplicate_window_ms > 0) {
+      std::lock_guard<std::mutex> lock(output_mutex());
+      Deduplicator::instance().expire(std::chrono::system_clock::now());
+    }
+    shard.busy.store(false);
+
+    bool flushed = !flush_requests.empty() && !halted_.load();
+    std::size_t depth = 0;
+    for (std::size_t list = index; list < kMaxShards; list += shards) {
+      ThreadQueue *previous = nullptr;
+      auto &queues = shards_[list].queues;
+      auto *queue = queues.load(std::memory_order_acquire);
+      while (queue) {
+        depth += queue->depth();
+        if (new_requests) {
+          queue->flush_target = queue->published_end();
+        }
+        flushed = flushed && queue->position() >= queue->flush_target;
+        queue = reclaim(queues, previous, queue);
+      }
+    }
+    shard.depth.store(depth, std::memory_order_relaxed);
+    if (!flushed) {
+      return count;
+    }
+    {
+      std::lock_guard<std::mutex> lock(output_mutex());
+      flush_repeats();
+      flush_sinks();
+    }
+    for (auto *request : flush_requests) {
+      std::lock_guard<std::mutex> lock(request->mutex);
+      if (--request->pending == 0) {
+        request->done = true;
+        request->cv.notify_all();
+      }
+    }
+    count += flush_requests.size();
+    flush_requests.clear();
+    return count;
+  }
+
+  template <typename T> static void store_max(std::atomic<T> &target, T value) {
+    auto current = target.load(std::memory_order_relaxed);
+    while (value > current &&
+           !target.compare_exchange_weak(current, value,
+                                         std::memory_order_relaxed)) {
+    }
+  }
+
+  // Returns false if `policy` dropped the new record. Time spent waiting
+  // for a slot is added to the queue's blocked time.
+  template <typename Fill>
+  bool enqueue(ThreadQueue *queue, OverflowPolicy policy, Fill &&fill) {
+    std::chrono::steady_clock::time_point blocked_since;
+    bool blocked = false;
+    while (!queue->try_push(fill)) {
+      wake(queue);
+      if (policy == OverflowPolicy::DropNewest) {
+        return false;
+      }
+      if (policy == OverflowPolicy::DropOldest) {
+        queue->drop_oldest();
+        drops_pending_.store(true, std::memory_order_release);
+      } else if (policy == OverflowPolicy::Grow) {
+        queue->grow();
+      } else {
+        if (!blocked) {
+          blocked_since = std::chrono::steady_clock::now();
+          blocked = true;
+        }
+        if (!running()) {
+          // No backend to free a slot; drain the queues ourselves
+          drain_if_stopped();
+        }
+        std::this_thread::yield();
+      }
+    }
+    queue->end.store(queue->tail->queue.end(), std::memory_order_seq_cst);
+    if (blocked) {
+      ThreadQueue::bump(queue->blocked_ns,
+                        static_cast<std::uint64_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() -
+                                blocked_since)
+                                .count()));
+    }
+    wake(queue);
+    return true;
+  }
+
+  // Unlinks `queue` from `queues` and frees it if its thread has exited and
+  // it is empty; returns the next queue to visit. Only the list's shard
+  // unlinks, and the list head is only moved with a CAS, as producers push
+  // there. Readers of the drop counters hold reclaim_mutex_ too.
+  ThreadQueue *reclaim(std::atomic<ThreadQueue *> &queues,
+                       ThreadQueue *&previous, ThreadQueue *queue) {
+    auto *next = queue->next;
+    // Retiring happens after the thread's last push, so check it first
+    if (!queue->retired.load(std::memory_order_acquire) || !queue->empty()) {
+      previous = queue;
+      return next;
+    }
+    std::lock_guard<std::mutex> lock(reclaim_mutex_);
+    if (previous) {
+      previous->next = next;
+    } else {
+      auto *expected = queue;
+      if (!queues.compare_exchange_strong(expected, next,
+                                           std::memory_order_acq_rel)) {
+        previous = queue; // A new thread registered; try again next pass
+        return next;
+      }
+    }
+    queue->add_to(retired_);
+    delete queue;
+    return next;
+  }
+
+  // Caller holds reclaim_mutex_
+  Totals totals_locked() {
+    auto totals = retired_;
+    for_each_queue([&](ThreadQueue *queue) { queue->add_to(totals); });
+    return totals;
+  }
+
+  // At most once a second, writes a WARN record counting the records
+  // dropped since the last one. Shard 0 only; its sleep ends in time for
+  // the next report while drops are pending.
+  void report_drops() {
+    if (!drops_pending_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_drop_report_ < kDropReportInterval) {
+      return;
+    }
+    drops_pending_.exchange(false, std::memory_order_acquire);
+    last_drop_report_ = now;
+    std::uint64_t total = 0;
+    for (auto count : totals().dropped) {
+      total += count;
+    }
+    if (total == reported_drops_) {
+      return;
+    }
+    auto count = total - reported_drops_;
+    reported_drops_ = total;
+
+    const auto &thread = ThreadInfo::instance().tag(
+        State::Hold()->thread_id_format);
+    auto time = std::chrono::system_clock::now();
+    auto &line = ThreadLocalBuffer::instance().line();
+    auto message = format_line(line, Level::WARN, time, thread.view(),
+                               __FILE__, __LINE__, [&] {
+                                 line.append_integer(count);
+                                 line.append(" log messages dropped (queue "
+                                             "full)");
+                               });
+    std::string_view text = line.view();
+    RecordView view{Level::WARN,
+                    time,
+                    thread.view(),
+                    __FILE__,
+                    __LINE__,
+                    text.substr(message.begin, message.end - message.begin),
+                    text,
+                    &reported_drops_,
+                    {},
+                    {},
+                    nullptr};
+    std::lock_guard<std::mutex> lock(output_mutex());
+    write_to_sinks(&view, 1);
+  }
+
+  // Deferred records are only formatted if some sink reads the text. A
+  // Batch record is written as its lines.
+  void dispatch(Shard &shard, std::size_t count) {
+    auto &entries = shard.entries;
+    auto &order = shard.order;
+    auto &views = shard.views;
+    views.clear();
+    std::lock_guard<std::mutex> lock(output_mutex());
+    bool want_text = sinks_want_text();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto &entry = entries[order[i]];
+      auto &record = entry.record;
+      std::string_view text = record.data;
+      std::string_view args;
+      MessageSpan message = record.message;
+      if (!record.batch.empty()) {
+        std::size_t begin = 0;
+        for (const auto &line : record.batch) {
+          auto line_text = text.substr(begin, line.end - begin);
+          begin = line.end;
+          views.push_back(RecordView{
+              line.level, record.time, record.thread.view(), line.file,
+              line.line,
+              line_text.substr(line.message.begin,
+                               line.message.end - line.message.begin),
+              line_text, line.site, {}, {}, record.logger});
+        }
+        continue;
+      }
+      if (record.decode) {
+        args = record.data;
+        text = {};
+        message = {};
+        if (want_text) {
+          auto &line = ThreadLocalBuffer::instance().line();
+          message = format_line(
+              line, record.line_format(), record.options, record.level,
+              record.time, record.thread.view(), record.file, record.line,
+              [&] { record.decode(record.data, line); },
+              [&] { decode_fields(record.data, line, record.format); });
+          entry.text.assign(line.data(), line.size());
+          text = entry.text;
+        }
+      }
+      views.push_back(RecordView{record.level,
+                                 record.time,
+                                 record.thread.view(),
+                                 record.file,
+                                 record.line,
+                                 text.substr(message.begin,
+                                             message.end - message.begin),
+                                 text,
+                                 record.site,
+                                 record.pattern,
+                                 args,
+                                 record.logger});
+    }
+    write_to_sinks(views.data(), views.size());
+    for (std::size_t i = 0; i < count; ++i) {
+      auto &record = entries[order[i]].record;
+      record.lazy_args.clear();
+      record.batch.clear();
+      record.layout.reset();
+    }
+
+    auto now = std::chrono::system_clock::now();
+    std::uint64_t total = 0;
+    std::uint64_t max = 0;
+    for (const auto &view : views) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - view.time)
+                    .count();
+      auto latency = static_cast<std::uint64_t>(std::max<decltype(ns)>(ns, 0));
+      total += latency;
+      max = std::max(max, latency);
+    }
+    latency_total_ns_.fetch_add(total, std::memory_order_relaxed);
+    store_max(latency_max_ns_, max);
+    latency_records_.fetch_add(views.size(), std::memory_order_relaxed);
+  }
+
+  std::array<Shard, kMaxShards> shards_;
+
+  // Read by producers on every call
+  alignas(kCacheLine) std::atomic<bool> running_{false};
+  // Bumped when the capacity grows, so threads replace their queues
+  std::atomic<std::uint64_t> generation_{0};
+  std::atomic<std::size_t> capacity_{0};
+  std::atomic<std::size_t> active_shards_{1};
+  std::atomic<IdleStrategy> idle_{IdleStrategy::Sleep};
+  std::atomic<std::chrono::milliseconds> max_sleep_{
+      std::chrono::milliseconds(100)};
+  std::atomic<bool> stop_requested_{false};
+  // Set by the crash handler
+  std::atomic<bool> halted_{false};
+  // Shard of the threads on each NUMA node
+  std::atomic<std::uint8_t> node_shard_[kMaxNodes] = {};
+
+  // Written by the backend on every pass
+  alignas(kCacheLine) std::atomic<std::size_t> high_water_{0};
+  std::atomic<std::uint64_t> latency_total_ns_{0};
+  std::atomic<std::uint64_t> latency_max_ns_{0};
+  std::atomic<std::uint64_t> latency_records_{0};
+  // Counters of freed queues, and the drops report_drops() has covered
+  Totals retired_;
+  std::uint64_t reported_drops_ = 0;
+  std::chrono::steady_clock::time_point last_drop_report_;
+  // Set by producers when they drop a record, after counting it; only
+  // under overflow, so kept off the lines above
+  alignas(kCacheLine) std::atomic<bool> drops_pending_{false};
+  std::mutex reclaim_mutex_;
+  std::mutex control_mutex_;
+};
+
+#if LOGGING_POSIX
+// On a fatal signal, writes out buffered and queued records with
+// async-signal-safe calls, then re-raises under the previous disposition.
+// Best effort: a backend thread still inside a sink write is not stopped.
+class CrashHandler {
+public:
+  static CrashHandler &instance() {
+    static CrashHandler instance;
+    return instance;
+  }
+
+  void install() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (installed_) {
+      return;
+    }
+    // Lets stack overflows reach the handler, in this thread and in those
+    // logging asynchronously
+    SignalStack::enable();
+
+    struct sigaction action {};
+    action.sa_handler = &CrashHandler::handle;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (std::size_t i = 0; i < kSignalCount; ++i) {
+      ::sigaction(kSignals[i], &action, &previous_[i]);
+    }
+    installed_ = true;
+  }
+
+private:
+  static constexpr int kSignals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+  static constexpr std::size_t kSignalCount = std::size(kSignals);
+
+  CrashHandler() {
+    // The handler must not construct anything
+    State::instance();
+    LoggerRegistry::instance();
+    Layouts::instance();
+    AsyncBackend::instance();
+    default_sink();
+  }
+
+  static void drain() {
+    auto &backend = AsyncBackend::instance();
+    backend.halt();
+    // A sink shared by several loggers is flushed more than once, which
+    // writes nothing the second time
+    each_active_sink([](Sink &sink) { sink.emergency_flush(); });
+    backend.emergency_drain(
+        instance().line_, [&](const Logger *logger, std::string_view text) {
+          each_sink(LoggerRegistry::sinks(logger),
+                    [&](Sink &sink) { sink.emergency_write(text); });
+        });
+  }
+
+  static void handle(int sig) {
+    auto &self = instance();
+    if (self.handling_.exchange(true)) {
+      // Another thread is draining and will end the process
+      while (true) {
+        ::pause();
+      }
+    }
+    drain();
+    for (std::size_t i = 0; i < kSignalCount; ++i) {
+      if (kSignals[i] == sig) {
+        ::sigaction(sig, &self.previous_[i], nullptr);
+      }
+    }
+    ::raise(sig); // Delivered once the handler returns
+  }
+
+  std::mutex mutex_;
+  bool installed_ = false;
+  std::atomic<bool> handling_{false};
+  struct sigaction previous_[kSignalCount] = {};
+  LineBuffer line_; // For drain(), which may not construct anything
+};
+#endif
+
+// The last records from call sites below their level, kept in deferred
+// form and only formatted when a record at or above the trigger level is
+// logged, which writes them out first. Each thread captures into a ring of
+// its own, claiming a slot with one uncontended CAS; only take() locks, and
+// it merges the rings by timestamp.
+class Backtrace {
+  static constexpr std::uint8_t kEmpty = 0;
+  static constexpr std::uint8_t kWriting = 1; // By the owning thread
+  static constexpr std::uint8_t kFull = 2;
+  static constexpr std::uint8_t kTaking = 3; // By take()
+
+  struct Slot {
+    std::atomic<std::uint8_t> state{kEmpty};
+    Record record;
+  };
+
+  // Slots and generation are set by the owning thread under mutex_
+  struct Ring {
+    std::unique_ptr<Slot[]> slots;
+    std::size_t capacity = 0;
+    std::uint64_t generation = 0;
+    std::size_t next = 0; // Owning thread only
+    Ring *next_ring = nullptr;
+  };
+
+  // The calling thread's ring, registered on its first capture. On exit
+  // its records move to the shared leftovers.
+  struct Owner {
+    Ring *ring = nullptr;
+    bool exited = false;
+
+    ~Owner() {
+      exited = true;
+      if (ring) {
+        instance().detach(ring);
+      }
+    }
+  };
+
+public:
+  static Backtrace &instance() {
+    static Backtrace instance;
+    return instance;
+  }
+
+  // Per thread. Discards what was kept; threads pick up the new size on
+  // their next capture.
+  void resize(std::size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    leftovers_.clear();
+    generation_.store(generation_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+  }
+
+  // Overwrites the calling thread's oldest record with one written by
+  // `fill`. Skipped if a dump is taking that slot right now.
+  template <typename Fill> void capture(Fill &&fill) {
+    thread_local Owner owner;
+    if (owner.exited) {
+      return;
+    }
+    auto *ring = owner.ring;
+    if (!ring ||
+        ring->generation != generation_.load(std::memory_order_acquire)) {
+      ring = owner.ring = attach(ring);
+    }
+    if (ring->capacity == 0) {
+      return;
+    }
+    auto &slot = ring->slots[ring->next];
+    auto state = slot.state.load(std::memory_order_relaxed);
+    if (state == kTaking ||
+        !slot.state.compare_exchange_strong(state, kWriting,
+                                            std::memory_order_acquire)) {
+      return;
+    }
+    fill(slot.record);
+    slot.state.store(kFull, std::memory_order_release);
+    ring->next = (ring->next + 1) % ring->capacity;
+  }
+
+  // Swaps every thread's captured records into the front of `records`,
+  // oldest first, leaving the rings empty. Returns how many there are.
+  std::size_t take(std::vector<Record> &records) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto generation = generation_.load(std::memory_order_relaxed);
+    std::size_t count = 0;
+    auto add = [&](Record &record) {
+      if (count == records.size()) {
+        records.emplace_back();
+      }
+      std::swap(records[count++], record);
+    };
+    for (auto &record : leftovers_) {
+      add(record);
+    }
+    leftovers_.clear();
+    for (auto *ring = rings_; ring; ring = ring->next_ring) {
+      if (ring->generation != generation) {
+        continue; // Left from before a resize()
+      }
+      for (std::size_t i = 0; i < ring->capacity; ++i) {
+        auto &slot = ring->slots[i];
+        auto state = kFull;
+        if (slot.state.compare_exchange_strong(state, kTaking,
+                                               std::memory_order_acquire)) {
+          add(slot.record);
+          slot.state.store(kEmpty, std::memory_order_release);
+        }
+      }
+    }
+    std::stable_sort(records.begin(),
+                     records.begin() + static_cast<std::ptrdiff_t>(count),
+                     [](const Record &a, const Record &b) {
+                       return a.time < b.time;
+                     });
+    return count;
+  }
+
+  // Writes out and clears the ring. Through the backend when it is running,
+  // ahead of anything the calling thread logs next.
+  void dump(const Config &config) {
+    thread_local std::vector<Record> records;
+    auto count = take(records);
+    if (count == 0) {
+      return;
+    }
+    auto &backend = AsyncBackend::instance();
+    std::size_t i = 0;
+    if (backend.running()) {
+      for (; i < count; ++i) {
+        auto &record = records[i];
+        auto policy =
+            config.overflow_policies[static_cast<std::size_t>(record.level)];
+        if (!backend.push(record.level, policy,
+                          [&](Record &slot) { std::swap(slot, record); })) {
+          break;
+        }
+      }
+    }
+    if (i == count) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(output_mutex());
+    bool want_text = sinks_want_text();
+    for (; i < count; ++i) {
+      auto &record = records[i];
+      std::string_view text;
+      MessageSpan message;
+      auto &line = ThreadLocalBuffer::instance().line();
+      if (want_text) {
+        message = format_line(
+            line, record.line_format(), record.options, record.level,
+            record.time, record.thread.view(), record.file, record.line,
+            [&] { record.decode(record.data, line); },
+            [&] { decode_fields(record.data, line, record.format); });
+        text = line.view();
+      }
+      RecordView view{record.level,
+                      record.time,
+                      record.thread.view(),
+                      record.file,
+                      record.line,
+                      text.substr(message.begin, message.end - message.begin),
+                      text,
+                      record.site,
+                      record.pattern,
+                      record.data,
+                      record.logger};
+      write_to_sinks(&view, 1);
+      record.lazy_args.clear();
+      record.layout.reset();
+    }
+  }
+
+private:
+  Backtrace() = default;
+
+  ~Backtrace() {
+    while (rings_) {
+      delete std::exchange(rings_, rings_->next_ring);
+    }
+  }
+
+  // Registers a ring for the calling thread, or resizes its own after a
+  // resize(), discarding what it held
+  Ring *attach(Ring *ring) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ring) {
+      ring = new Ring;
+      ring->next_ring = rings_;
+      rings_ = ring;
+    }
+    ring->slots = std::make_unique<Slot[]>(capacity_);
+    ring->capacity = capacity_;
+    ring->next = 0;
+    ring->generation = generation_.load(std::memory_order_relaxed);
+    return ring;
+  }
+
+  // Frees an exiting thread's ring. Its records join the leftovers, of
+  // which only the newest `capacity_` are kept.
+  void detach(Ring *ring) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto **link = &rings_;
+    while (*link != ring) {
+      link = &(*link)->next_ring;
+    }
+    *link = ring->next_ring;
+    if (ring->generation == generation_.load(std::memory_order_relaxed)) {
+      for (std::size_t i = 0; i < ring->capacity; ++i) {
+        if (ring->slots[i].state.load(std::memory_order_relaxed) == kFull) {
+          leftovers_.push_back(std::move(ring->slots[i].record));
+        }
+      }
+      if (leftovers_.size() > capacity_) {
+        std::stable_sort(leftovers_.begin(), leftovers_.end(),
+                         [](const Record &a, const Record &b) {
+                           return a.time < b.time;
+                         });
+        leftovers_.erase(leftovers_.begin(),
+                         leftovers_.end() -
+                             static_cast<std::ptrdiff_t>(capacity_));
+      }
+    }
+    delete ring;
+  }
+
+  std::mutex mutex_;
+  Ring *rings_ = nullptr;
+  std::vector<Record> leftovers_; // From exited threads
+  std::size_t capacity_ = 0;
+  // Bumped by resize(), so threads resize their rings
+  std::atomic<std::uint64_t> generation_{0};
+};
+
+constexpr int kActiveLevel = LOGGING_ACTIVE_LEVEL;
+
+constexpr bool is_compiled_in(Level level) {
+  return static_cast<int>(level) >= kActiveLevel;
+}
+
+class CallSite;
+inline bool register_call_site(CallSite &site,
+                               const Logger *logger = nullptr);
+
+// Static metadata for one LOG_* expansion. Constant-initialised, registered
+// on first use; the enable flag is recomputed whenever levels change, so the
+// disabled check is a single relaxed load and branch.
+class CallSite {
+public:
+  constexpr CallSite(const char *file, int line, Level level)
+      : file(file), line(line), level(level) {}
+
+  // True for sites that are captured for the backtrace, too
+  bool enabled() {
+    auto state = state_.load(std::memory_order_relaxed);
+    return state != kDisabled &&
+           (state != kUnregistered || register_call_site(*this));
+  }
+
+  // For the LOGGER_* macros. The flag follows the logger the site was
+  // registered with; a site reached with another one checks its level.
+  bool enabled(const Logger &logger) {
+    auto state = state_.load(std::memory_order_relaxed);
+    if (state == kUnregistered) {
+      return register_call_site(*this, &logger);
+    }
+    if (logger_.load(std::memory_order_relaxed) != &logger) {
+      return level >= logger.get_level();
+    }
+    return state != kDisabled;
+  }
+
+  // Whether an enabled call only goes to the backtrace ring
+  bool captured(const Logger *logger) const {
+    return state_.load(std::memory_order_relaxed) == kCapture &&
+           logger_.load(std::memory_order_relaxed) == logger;
+  }
+
+  const char *const file;
+  const int line;
+  const Level level;
+
+private:
+  friend class SiteRegistry;
+
+  static constexpr std::uint8_t kUnregistered = 0;
+  static constexpr std::uint8_t kDisabled = 1;
+  static constexpr std::uint8_t kEnabled = 2;
+  static constexpr std::uint8_t kCapture = 3; // Below its level
+
+  std::atomic<std::uint8_t> state_{kUnregistered};
+  std::atomic<const Logger *> logger_{nullptr};
+  CallSite *next_ = nullptr;
+};
+
+// Per-site state of the rate-limited macros. Each allow() is only reached
+// by enabled calls, and a false return skips the argument evaluation.
+
+// Lets through the first of every `n` calls
+class EveryN {
+public:
+  bool allow(std::uint64_t n) {
+    return n <= 1 || count_.fetch_add(1, std::memory_order_relaxed) % n == 0;
+  }
+
+private:
+  // Written by every call, so kept off neighbouring call sites' lines
+  alignas(kCacheLine) std::atomic<std::uint64_t> count_{0};
+};
+
+// Lets through at most one call every `ms` milliseconds; if several threads
+// get there at once, one wins
+class EveryMs {
+public:
+  bool allow(std::int64_t ms) {
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count();
+    auto due = next_.load(std::memory_order_relaxed);
+    return now >= due &&
+           next_.compare_exchange_strong(due, now + ms * 1000000,
+                                         std::memory_order_relaxed);
+  }
+
+private:
+  alignas(kCacheLine) std::atomic<std::int64_t> next_{
+      std::numeric_limits<std::int64_t>::min()};
+};
+
+// Lets through each call with probability `p`, using a thread-local
+// xorshift generator
+class Sampler {
+public:
+  bool allow(double p) {
+    if (p >= 1.0) {
+      return true;
+    }
+    thread_local std::uint64_t state = seed();
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    auto bits = (state * 0x2545F4914F6CDD1DULL) >> 11;
+    return static_cast<double>(bits) * 0x1.0p-53 < p;
+  }
+
+private:
+  static std::uint64_t seed() {
+    std::uint64_t local = 0;
+    auto value = reinterpret_cast<std::uintptr_t>(&local) ^
+                 static_cast<std::uint64_t>(
+                     std::chrono::steady_clock::now().time_since_epoch().count());
+    return value ? value : 0x9E3779B97F4A7C15ULL;
+  }
+};
+
+// Every call site seen so far, plus the per-file and per-site overrides used
+// to compute their enable flags
+class SiteRegistry {
+public:
+  static SiteRegistry &instance() {
+    static SiteRegistry instance;
+    return instance;
+  }
+
+  bool add(CallSite &site, const Logger *logger) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (site.state_.load(std::memory_order_relaxed) ==
+        CallSite::kUnregistered) {
+      site.logger_.store(logger, std::memory_order_relaxed);
+      site.next_ = head_;
+      head_ = &site;
+      update(site);
+    }
+    return site.state_.load(std::memory_order_relaxed) != CallSite::kDisabled;
+  }
+
+  void set_file_level(std::string_view file, Level level) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it =
+        std::find_if(file_levels_.begin(), file_levels_.end(),
+                     [&](const auto &entry) { return entry.file == file; });
+    if (it != file_levels_.end()) {
+      it->level = level;
+    } else {
+      file_levels_.push_back({std::string(file), level});
+    }
+    update_all();
+  }
+
+  void set_site_enabled(std::string_view file, int line, bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(site_overrides_.begin(), site_overrides_.end(),
+                           [&](const auto &entry) {
+                             return entry.file == file && entry.line == line;
+                           });
+    if (it != site_overrides_.end()) {
+      it->enabled = enabled;
+    } else {
+      site_overrides_.push_back({std::string(file), line, enabled});
+    }
+    update_all();
+  }
+
+  void clear_overrides() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_levels_.clear();
+    site_overrides_.clear();
+    update_all();
+  }
+
+  // Call after changing the global level, a logger's or the backtrace
+  void refresh() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    update_all();
+  }
+
+  // Level changes applied together. A file entry without a level drops that
+  // file's override.
+  struct LevelChanges {
+    bool global = false;
+    std::vector<const Logger *> loggers;
+    std::vector<std::pair<std::string, std::optional<Level>>> files;
+  };
+
+  // Recomputes only the sites that `changes` can affect
+  void apply(const LevelChanges &changes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &[file, level] : changes.files) {
+      auto it =
+          std::find_if(file_levels_.begin(), file_levels_.end(),
+                       [&](const auto &entry) { return entry.file == file; });
+      if (!level) {
+        if (it != file_levels_.end()) {
+          file_levels_.erase(it);
+        }
+      } else if (it != file_levels_.end()) {
+        it->level = *level;
+      } else {
+        file_levels_.push_back({file, *level});
+      }
+    }
+    for (auto *site = head_; site; site = site->next_) {
+      const auto *logger = site->logger_.load(std::memory_order_relaxed);
+      bool affected =
+          (changes.global && !logger) ||
+          std::find(changes.loggers.begin(), changes.loggers.end(), logger) !=
+              changes.loggers.end() ||
+          std::any_of(changes.files.begin(), changes.files.end(),
+                      [&](const auto &entry) {
+                        return file_matches(site->file, entry.first);
+                      });
+      if (affected) {
+        update(*site);
+      }
+    }
+  }
+
+private:
+  struct FileLevel {
+    std::string file;
+    Level level;
+  };
+
+  struct SiteOverride {
+    std::string file;
+    int line;
+    bool enabled;
+  };
+
+  SiteRegistry() = default;
+
+  // "net/socket.cpp" matches "/src/net/socket.cpp" but not "/src/xnet/..."
+  static bool file_matches(std::string_view path, std::string_view pattern) {
+    if (pattern.size() > path.size() ||
+        path.substr(path.size() - pattern.size()) != pattern) {
+      return false;
+    }
+    if (pattern.size() == path.size()) {
+      return true;
+    }
+    char before = path[path.size() - pattern.size() - 1];
+    return before == '/' || before == '\\';
+  }
+
+  std::uint8_t compute(const CallSite &site) const {
+    for (const auto &entry : site_overrides_) {
+      if (entry.line == site.line && file_matches(site.file, entry.file)) {
+        return entry.enabled ? CallSite::kEnabled : CallSite::kDisabled;
+      }
+    }
+    const auto *logger = site.logger_.load(std::memory_order_relaxed);
+    auto threshold = logger ? logger->get_level()
+                            : State::instance().level();
+    for (const auto &entry : file_levels_) {
+      if (file_matches(site.file, entry.file)) {
+        threshold = entry.level;
+        break;
+      }
+    }
+    if (site.level >= threshold) {
+      return CallSite::kEnabled;
+    }
+    return State::Hold()->backtrace ? CallSite::kCapture
+                                    : CallSite::kDisabled;
+  }
+
+  // Unchanged flags are not written, so the cache lines of busy sites stay
+  // shared between the cores logging through them
+  void update(CallSite &site) {
+    auto state = compute(site);
+    if (site.state_.load(std::memory_order_relaxed) != state) {
+      site.state_.store(state, std::memory_order_relaxed);
+    }
+  }
+
+  void update_all() {
+    for (auto *site = head_; site; site = site->next_) {
+      update(*site);
+    }
+  }
+
+  std::mutex mutex_;
+  CallSite *head_ = nullptr;
+  std::vector<FileLevel> file_levels_;
+  std::vector<SiteOverride> site_overrides_;
+};
+
+// Slow path of CallSite::enabled(), taken once per site
+inline bool register_call_site(CallSite &site, const Logger *logger) {
+  return SiteRegistry::instance().add(site, logger);
+}
+
+// Shared tail of every log call. `encode` captures the arguments for a
+// deferred record; `write_message` and `write_fields` format them in place.
+// `pattern` is the format string, if any, passed through to sinks.
+// `logger` is null for the default logger. Records with `lazy` arguments
+// are deferred whenever the backend is running.
+template <typename Encode, typename WriteMessage, typename WriteFields>
+void write_record(const CallSite &site, const Logger *logger, DecodeFn decode,
+                  std::string_view pattern, bool lazy, Encode &&encode,
+                  WriteMessage &&write_message, WriteFields &&write_fields) {
+  State::Hold hold;
+  const auto &config = *hold;
+  Level level = site.level;
+  std::string_view file = site.file;
+  int line = site.line;
+  auto time = std::chrono::system_clock::now();
+  const auto &thread = ThreadInfo::instance().tag(config.thread_id_format);
+  auto options = LoggerRegistry::options(config, logger);
+  auto &buffer = ThreadLocalBuffer::instance();
+  // A deferred record is formatted later, but as of now
+  auto set_format = [&](Record &record, const Layouts::Hold &layout) {
+    record.format = config.output_format;
+    record.precision = config.timestamp_precision;
+    record.options = options;
+    if (config.output_format == OutputFormat::Text) {
+      record.layout = layout.shared();
+    } else {
+      record.layout.reset();
+    }
+  };
+
+  // Records below their level only go to the backtrace ring; one at or
+  // above the trigger writes the ring out first
+  if (site.captured(logger)) {
+    auto &encoded = buffer.scratch();
+    encode(encoded);
+    Layouts::Hold layout;
+    Backtrace::instance().capture([&](Record &record) {
+      record.level = level;
+      record.decode = decode;
+      record.site = &site;
+      record.logger = logger;
+      record.pattern = pattern;
+      record.file = file;
+      record.line = line;
+      record.time = time;
+      record.thread = thread;
+      record.data.assign(encoded.data(), encoded.size());
+      record.lazy_args.swap(buffer.lazy_args());
+      record.message = {};
+      record.batch.clear();
+      record.flush = nullptr;
+      set_format(record, layout);
+    });
+    buffer.lazy_args().clear();
+    return;
+  }
+  if (config.backtrace && level >= config.backtrace_trigger) {
+    Backtrace::instance().dump(config);
+  }
+
+  // Deferred mode copies the raw arguments and lets the backend format them.
+  // A thread that is exiting has no queue and writes synchronously.
+  auto &backend = AsyncBackend::instance();
+  auto policy = config.overflow_policies[static_cast<std::size_t>(level)];
+  if (backend.running() && (lazy || config.deferred_formatting)) {
+    auto &encoded = buffer.scratch();
+    encode(encoded);
+    Layouts::Hold layout;
+    auto fill = [&](Record &record) {
+      record.level = level;
+      record.decode = decode;
+      record.site = &site;
+      record.logger = logger;
+      record.pattern = pattern;
+      record.file = file;
+      record.line = line;
+      record.time = time;
+      record.thread = thread;
+      record.data.assign(encoded.data(), encoded.size());
+      record.lazy_args.swap(buffer.lazy_args());
+      record.message = {};
+      record.batch.clear();
+      record.flush = nullptr;
+      set_format(record, layout);
+    };
+    bool queued = backend.push(level, policy, fill);
+    buffer.lazy_args().clear();
+    if (queued) {
+      return;
+    }
+  }
+
+  // Format the whole line in the thread-local buffer
+  auto &log_line = buffer.line();
+  auto message = format_line(
+      log_line, line_format(config), options, level, time, thread.view(), file,
+      line, [&] { write_message(buffer, log_line); },
+      [&] { write_fields(buffer, log_line, config.output_format); });
+
+  // Hand off to the background writer when async mode is on
+  auto fill = [&](Record &record) {
+    record.level = level;
+    record.decode = nullptr;
+    record.site = &site;
+    record.logger = logger;
+    record.pattern = pattern;
+    record.file = file;
+    record.line = line;
+    record.time = time;
+    record.thread = thread;
+    record.data.assign(log_line.data(), log_line.size());
+    record.lazy_args.clear();
+    record.message = message;
+    record.batch.clear();
+    record.flush = nullptr;
+  };
+  if (backend.running() && backend.push(level, policy, fill)) {
+    return;
+  }
+
+  // Thread-safe output to the sinks
+  std::string_view text = log_line.view();
+  RecordView view{level,
+                  time,
+                  thread.view(),
+                  file,
+                  line,
+                  text.substr(message.begin, message.end - message.begin),
+                  text,
+                  &site,
+                  pattern,
+                  {},
+                  logger};
+  std::lock_guard<std::mutex> lock(output_mutex());
+  write_to_sinks(&view, 1);
+}
+
+// Core logging function
+template <typename... Args>
+void log_impl(const CallSite &site, const Logger *logger, Args &&...args) {
+  constexpr bool lazy = (is_lazy_arg<Args>() || ...);
+  write_record(
+      site, logger, &decode_args, {}, lazy,
+      [&](std::string &encoded) { encode_args(encoded, args...); },
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out) {
+        append_message(buffer, out, args...);
+      },
+      [](ThreadLocalBuffer &, LineBuffer &, OutputFormat) {});
+}
+
+template <typename T> struct is_key_value : std::false_type {};
+template <typename T> struct is_key_value<KeyValue<T>> : std::true_type {};
+
+template <typename T> struct is_lazy_field : std::false_type {};
+template <typename T>
+struct is_lazy_field<KeyValue<T>>
+    : std::bool_constant<is_lazy_arg<T>()> {};
+
+// The message and the fields of a structured call
+template <typename... Args>
+void append_kv_message(ThreadLocalBuffer &buffer, LineBuffer &out,
+                       const Args &...args) {
+  auto append = [&](const auto &arg) {
+    if constexpr (!is_key_value<std::decay_t<decltype(arg)>>::value) {
+      append_arg(buffer, out, arg);
+    }
+  };
+  (append(args), ...);
+}
+
+template <typename... Args>
+void append_kv_fields(ThreadLocalBuffer &buffer, LineBuffer &out,
+                      OutputFormat format, const Args &...args) {
+  auto append = [&](const auto &arg) {
+    if constexpr (is_key_value<std::decay_t<decltype(arg)>>::value) {
+      append_field(buffer, out, format, arg);
+    }
+  };
+  (append(args), ...);
+}
+
+// Structured logging: KeyValue arguments become fields, the rest make up the
+// message
+template <typename... Args>
+void log_kv_impl(const CallSite &site, const Logger *logger,
+                 const Args &...args) {
+  auto encode_message = [](std::string &encoded, const auto &arg) {
+    if constexpr (!is_key_value<std::decay_t<decltype(arg)>>::value) {
+      encode_arg(encoded, arg);
+    }
+  };
+  auto encode = [](std::string &encoded, const auto &arg) {
+    if constexpr (is_key_value<std::decay_t<decltype(arg)>>::value) {
+      encode_field(encoded, arg);
+    }
+  };
+  constexpr bool lazy = (is_lazy_arg<Args>() || ...) ||
+                        (is_lazy_field<Args>::value || ...);
+  write_record(
+      site, logger, &decode_args, {}, lazy,
+      [&](std::string &encoded) {
+        (encode_message(encoded, args), ...);
+        (encode(encoded, args), ...);
+      },
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out) {
+        append_kv_message(buffer, out, args...);
+      },
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out, OutputFormat format) {
+        append_kv_fields(buffer, out, format, args...);
+      });
+}
+
+// Format-string logging; `Pattern` carries the literal as a constant
+template <typename Pattern, std::size_t N, typename... Args>
+void logf_impl(const CallSite &site, const Logger *logger, const char (&)[N],
+               const Args &...args) {
+  static_assert(FormatSpec<Pattern>::kArgs == sizeof...(Args),
+                "number of {} placeholders does not match the arguments");
+  write_record(
+      site, logger, &decode_formatted<Pattern>, Pattern::value(),
+      (is_lazy_arg<Args>() || ...),
+      [&](std::string &encoded) { (encode_arg(encoded, args), ...); },
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out) {
+        append_formatted<Pattern>(std::index_sequence_for<Args...>{}, buffer,
+                                  out, args...);
+      },
+      [](ThreadLocalBuffer &, LineBuffer &, OutputFormat) {});
+}
+
+inline bool is_level_enabled(Level level) {
+  return level >= State::instance().level();
+}
+
+} // namespace detail
+
+// Public confuiguration functions
+inline void set_level(Level level) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.current_level = level; });
+  detail::SiteRegistry::LevelChanges changes;
+  changes.global = true;
+  detail::SiteRegistry::instance().apply(changes);
+}
+
+// Per-file override of the global level. `file` matches any path ending in
+// it at a directory boundary, e.g. "net/socket.cpp".
+inline void set_file_level(std::string_view file, Level level) {
+  detail::SiteRegistry::instance().set_file_level(file, level);
+}
+
+// Force a single call site on or off, regardless of levels
+inline void set_call_site_enabled(std::string_view file, int line,
+                                  bool enabled) {
+  detail::SiteRegistry::instance().set_site_enabled(file, line, enabled);
+}
+
+// Drops all per-file and per-call-site overrides
+inline void clear_level_overrides() {
+  detail::SiteRegistry::instance().clear_overrides();
+}
+
+inline void set_include_location(bool enable) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.include_location = enable; });
+}
+
+inline void set_include_thread_id(bool enable) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.include_thread_id = enable; });
+}
+
+inline void set_thread_id_format(ThreadIdFormat format) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.thread_id_format = format; });
+}
+
+// Layout of Text lines: %t timestamp, %i thread ID, %l level, %m message
+// and fields, %f file, %n line, %% a literal %. The pattern is compiled once
+// here. A custom pattern ignores set_include_thread_id() and
+// set_include_location(); an empty one restores the default layout. Throws
+// std::invalid_argument for unknown fields or without exactly one %m.
+inline void set_pattern(std::string_view pattern) {
+  detail::Layouts::instance().set(pattern);
+}
+
+inline void set_use_colours(bool enable) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.use_colours = enable; });
+}
+
+inline void set_flush_policy(const FlushPolicy &policy) {
+  detail::State::instance().update([&](detail::Config &config) {
+    config.flush_level = policy.level;
+    config.flush_max_buffered_bytes = policy.max_buffered_bytes;
+    config.flush_interval_ms = policy.interval.count();
+  });
+  if (policy.interval.count() > 0) {
+    detail::FlushTimer::instance().start();
+  }
+}
+
+inline FlushPolicy get_flush_policy() {
+  detail::State::Hold config;
+  FlushPolicy policy;
+  policy.level = config->flush_level;
+  policy.interval = std::chrono::milliseconds(config->flush_interval_ms);
+  policy.max_buffered_bytes = config->flush_max_buffered_bytes;
+  return policy;
+}
+
+// Sinks. With none configured, output goes to a ConsoleSink on std::cerr.
+// Sinks leaving the active set are flushed first.
+inline void add_sink(std::shared_ptr<Sink> sink) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  auto &sinks = detail::State::instance().sinks;
+  if (sinks.empty()) {
+    detail::default_sink().flush();
+  }
+  sinks.push_back(std::move(sink));
+}
+
+inline void remove_sink(const std::shared_ptr<Sink> &sink) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  auto &sinks = detail::State::instance().sinks;
+  auto it = std::find(sinks.begin(), sinks.end(), sink);
+  if (it != sinks.end()) {
+    (*it)->flush();
+    sinks.erase(it);
+  }
+}
+
+inline void set_sinks(std::vector<std::shared_ptr<Sink>> sinks) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  detail::flush_sinks();
+  detail::State::instance().sinks = std::move(sinks);
+}
+
+inline Level get_level() {
+  return detail::State::instance().level();
+}
+
+// The logger called `name`, created on first use
+inline Logger &get(std::string_view name) {
+  return detail::LoggerRegistry::instance().get(name);
+}
+
+inline void Logger::set_level(Level level) {
+  level_.store(level, std::memory_order_relaxed);
+  detail::SiteRegistry::LevelChanges changes;
+  changes.loggers.push_back(this);
+  detail::SiteRegistry::instance().apply(changes);
+}
+
+// With none of its own, a logger writes to the default logger's sinks
+inline void Logger::add_sink(std::shared_ptr<Sink> sink) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  sinks_.push_back(std::move(sink));
+}
+
+inline void Logger::remove_sink(const std::shared_ptr<Sink> &sink) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  auto it = std::find(sinks_.begin(), sinks_.end(), sink);
+  if (it != sinks_.end()) {
+    (*it)->flush();
+    sinks_.erase(it);
+  }
+}
+
+inline void Logger::set_sinks(std::vector<std::shared_ptr<Sink>> sinks) {
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  for (const auto &sink : sinks_) {
+    sink->flush();
+  }
+  sinks_ = std::move(sinks);
+}
+
+// Asynchronous mode: log calls enqueue the formatted line on a queue owned
+// by the calling thread and a background thread writes it out. The capacity
+// is per thread. Call shutdown() (or let the process exit) to drain; options
+// take effect on the next enable_async() after that.
+inline void enable_async(const AsyncOptions &options) {
+  detail::AsyncBackend::instance().start(options);
+}
+
+inline void enable_async(
+    std::size_t queue_capacity = detail::AsyncBackend::kDefaultCapacity) {
+  AsyncOptions options;
+  options.queue_capacity = queue_capacity;
+  enable_async(options);
+}
+
+inline void set_output_format(OutputFormat format) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.output_format = format; });
+}
+
+inline void set_timestamp_precision(TimestampPrecision precision) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.timestamp_precision = precision; });
+}
+
+// Deferred formatting: in async mode, log calls only capture the level,
+// location, timestamp and argument values; the backend does the formatting.
+inline void set_deferred_formatting(bool enable) {
+  detail::State::instance().update(
+      [&](detail::Config &config) { config.deferred_formatting = enable; });
+}
+
+// What an async log call does when its thread's queue is full
+inline void set_overflow_policy(Level level, OverflowPolicy policy) {
+  detail::State::instance().update([&](detail::Config &config) {
+    config.overflow_policies[static_cast<std::size_t>(level)] = policy;
+  });
+}
+
+inline void set_overflow_policy(OverflowPolicy policy) {
+  detail::State::instance().update([&](detail::Config &config) {
+    config.overflow_policies.fill(policy);
+  });
+}
+
+inline OverflowPolicy get_overflow_policy(Level level) {
+  return detail::State::Hold()
+      ->overflow_policies[static_cast<std::size_t>(level)];
+}
+
+// Records discarded by the DropNewest and DropOldest policies
+inline std::uint64_t get_dropped_count(Level level) {
+  return detail::AsyncBackend::instance()
+      .totals()
+      .dropped[static_cast<std::size_t>(level)];
+}
+
+inline std::uint64_t get_dropped_count() {
+  std::uint64_t total = 0;
+  for (auto count : detail::AsyncBackend::instance().totals().dropped) {
+    total += count;
+  }
+  return total;
+}
+
+// The logger's own counters, as returned by stats(). Per-level arrays are
+// indexed by static_cast<std::size_t>(Level).
+struct Stats {
+  struct SinkBytes {
+    std::shared_ptr<Sink> sink;
+    std::uint64_t bytes = 0;
+  };
+
+  std::array<std::uint64_t, detail::kLevelCount> enqueued = {}; // Async only
+  std::array<std::uint64_t, detail::kLevelCount> written = {};
+  std::array<std::uint64_t, detail::kLevelCount> dropped = {};
+  // Records waiting in all threads' queues, and the most seen in a single
+  // queue, as of the backend's last pass
+  std::size_t queue_depth = 0;
+  std::size_t queue_high_water = 0;
+  std::vector<SinkBytes> sinks; // Configured sinks, in order
+  // From log call to the backend handing the record to the sinks
+  std::chrono::nanoseconds drain_latency_mean{0};
+  std::chrono::nanoseconds drain_latency_max{0};
+  // Spent by producers waiting for a free slot under OverflowPolicy::Block
+  std::chrono::nanoseconds producer_blocked{0};
+};
+
+// Counters are kept per thread or by the backend and only summed here, so
+// logging does not pay for them.
+inline Stats stats() {
+  Stats result;
+  auto &backend = detail::AsyncBackend::instance();
+  auto totals = backend.totals();
+  result.enqueued = totals.enqueued;
+  result.dropped = totals.dropped;
+  result.producer_blocked = std::chrono::nanoseconds(totals.blocked_ns);
+  result.queue_depth = backend.depth();
+  result.queue_high_water = backend.high_water();
+  auto records = backend.latency_records();
+  if (records > 0) {
+    result.drain_latency_mean =
+        std::chrono::nanoseconds(backend.latency_total_ns() / records);
+  }
+  result.drain_latency_max =
+      std::chrono::nanoseconds(backend.latency_max_ns());
+
+  auto &state = detail::State::instance();
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  std::copy(std::begin(state.written), std::end(state.written),
+            result.written.begin());
+  auto add = [&](const std::shared_ptr<Sink> &sink) {
+    if (std::none_of(result.sinks.begin(), result.sinks.end(),
+                     [&](const auto &entry) { return entry.sink == sink; })) {
+      result.sinks.push_back({sink, sink->bytes_written()});
+    }
+  };
+  std::for_each(state.sinks.begin(), state.sinks.end(), add);
+  detail::LoggerRegistry::instance().for_each([&](Logger &logger) {
+    const auto &sinks = detail::LoggerRegistry::own_sinks(logger);
+    std::for_each(sinks.begin(), sinks.end(), add);
+  });
+  return result;
+}
+
+// Coalesces repeats of the same message from the same call site within
+// `window` into one "last message repeated N times" record. Zero, the
+// default, turns it off and writes any pending summaries.
+inline void set_duplicate_suppression(std::chrono::milliseconds window) {
+  detail::State::instance().update([&](detail::Config &config) {
+    config.duplicate_window_ms = window.count();
+  });
+  if (window.count() <= 0) {
+    std::lock_guard<std::mutex> lock(detail::output_mutex());
+    detail::flush_repeats(true);
+  }
+}
+
+// Keeps each thread's last `capacity` records from call sites below their
+// level in memory, unformatted, and writes them out in time order just before
+// the next record at or above `trigger`. Those calls then evaluate their
+// arguments again. Zero turns it off and discards what was kept.
+inline void enable_backtrace(std::size_t capacity,
+                             Level trigger = Level::ERROR) {
+  detail::Backtrace::instance().resize(capacity);
+  detail::State::instance().update([&](detail::Config &config) {
+    config.backtrace_trigger = trigger;
+    config.backtrace = capacity > 0;
+  });
+  detail::SiteRegistry::instance().refresh();
+}
+
+inline void disable_backtrace() { enable_backtrace(0); }
+
+// Writes out the backtrace ring now
+inline void dump_backtrace() {
+  detail::Backtrace::instance().dump(*detail::State::Hold());
+}
+
+inline bool is_async() { return detail::AsyncBackend::instance().running(); }
+
+// Blocks until every record logged before the call has been written
+inline void flush() {
+  auto &backend = detail::AsyncBackend::instance();
+  if (backend.running()) {
+    backend.flush();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(detail::output_mutex());
+  detail::flush_repeats();
+  detail::flush_sinks();
+}
+
+// Drains the queue, stops the backend thread and returns to synchronous mode
+inline void shutdown() { detail::AsyncBackend::instance().stop(); }
+
+#if LOGGING_POSIX
+// On SIGSEGV, SIGABRT, SIGBUS, SIGFPE or SIGILL, writes every record still
+// buffered or queued to the sinks before the signal takes its previous
+// course. A stack overflow is only caught on threads with an alternate
+// signal stack: the installing one, and those whose first async log call
+// comes after it. Install it before starting worker threads.
+inline void install_crash_handler() {
+  detail::CrashHandler::instance().install();
+}
+#endif
+
+// Collects the lines of the BATCH_* macros and writes them as one unit on
+// commit() or destruction: one timestamp, one queue slot in async mode and
+// one lock of the sinks otherwise, with no other thread's lines in between.
+// Lines are formatted as they are added, even with deferred formatting on.
+// Not thread-safe; each thread keeps its own.
+//
+//   logging::Batch batch;
+//   BATCH_INFO(batch, "requests: ", requests);
+//   BATCH_INFO(batch, "errors: ", errors);
+class Batch {
+public:
+  Batch() = default;
+  // Lines go through `logger`'s level and sinks
+  explicit Batch(Logger &logger) : logger_(&logger) {}
+  ~Batch() { commit(); }
+
+  Batch(const Batch &) = delete;
+  Batch &operator=(const Batch &) = delete;
+
+  std::size_t size() const { return lines_.size(); }
+  bool empty() const { return lines_.empty(); }
+  Logger *logger() const { return logger_; }
+
+  // Writes the lines collected so far; the batch can then be reused
+  void commit() {
+    if (lines_.empty()) {
+      return;
+    }
+    detail::State::Hold hold;
+    const auto &config = *hold;
+    if (config.backtrace && level_ >= config.backtrace_trigger) {
+      detail::Backtrace::instance().dump(config);
+    }
+    auto &backend = detail::AsyncBackend::instance();
+    auto policy = config.overflow_policies[static_cast<std::size_t>(level_)];
+    auto fill = [&](detail::Record &record) {
+      record.level = level_;
+      record.decode = nullptr;
+      record.site = lines_.front().site;
+      record.logger = logger_;
+      record.pattern = {};
+      record.file = lines_.front().file;
+      record.line = lines_.front().line;
+      record.time = time_;
+      record.thread = thread_;
+      // The slot's old buffers come back for the next commit
+      record.data.swap(text_);
+      record.lazy_args.clear();
+      record.message = {};
+      record.batch.swap(lines_);
+      record.flush = nullptr;
+    };
+    if (!backend.running() || !backend.push(level_, policy, fill, &counts_)) {
+      std::size_t begin = 0;
+      for (const auto &line : lines_) {
+        std::string_view text(text_.data() + begin, line.end - begin);
+        begin = line.end;
+        views_.push_back(RecordView{
+            line.level, time_, thread_.view(), line.file, line.line,
+            text.substr(line.message.begin,
+                        line.message.end - line.message.begin),
+            text, line.site, {}, {}, logger_});
+      }
+      std::lock_guard<std::mutex> lock(detail::output_mutex());
+      detail::write_to_sinks(views_.data(), views_.size());
+    }
+    lines_.clear();
+    views_.clear();
+    text_.clear();
+    counts_ = {};
+  }
+
+  // For the BATCH_* macros
+  bool enabled(detail::CallSite &site) {
+    return logger_ ? site.enabled(*logger_) : site.enabled();
+  }
+
+  template <typename WriteMessage, typename WriteFields>
+  void add(const detail::CallSite &site, WriteMessage &&write_message,
+           WriteFields &&write_fields) {
+    detail::State::Hold hold;
+    const auto &config = *hold;
+    if (lines_.empty()) {
+      time_ = std::chrono::system_clock::now();
+      thread_ = detail::ThreadInfo::instance().tag(config.thread_id_format);
+      level_ = site.level;
+    }
+    auto &buffer = detail::ThreadLocalBuffer::instance();
+    auto &line = buffer.line();
+    auto message = detail::format_line(
+        line, detail::line_format(config),
+        detail::LoggerRegistry::options(config, logger_),
+        site.level, time_, thread_.view(), site.file, site.line,
+        [&] { write_message(buffer, line); },
+        [&] { write_fields(buffer, line, config.output_format); });
+    text_.append(line.data(), line.size());
+    lines_.push_back({site.level, &site, site.file, site.line, text_.size(),
+                      message});
+    level_ = std::max(level_, site.level);
+    ++counts_[static_cast<std::size_t>(site.level)];
+  }
+
+private:
+  Logger *logger_ = nullptr;
+  Level level_ = Level::INFO; // Highest of the lines
+  std::chrono::system_clock::time_point time_;
+  detail::ThreadTag thread_;
+  std::string text_;
+  std::vector<detail::BatchLine> lines_;
+  std::vector<RecordView> views_;
+  detail::LineCounts counts_ = {};
+};
+
+namespace detail {
+// A site below its level sends the call to the backtrace ring as usual
+template <typename... Args>
+void batch_impl(Batch &batch, CallSite &site, const Args &...args) {
+  if (site.captured(batch.logger())) {
+    log_impl(site, batch.logger(), args...);
+    return;
+  }
+  batch.add(
+      site,
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out) {
+        append_message(buffer, out, args...);
+      },
+      [](ThreadLocalBuffer &, LineBuffer &, OutputFormat) {});
+}
+
+template <typename... Args>
+void batch_kv_impl(Batch &batch, CallSite &site, const Args &...args) {
+  if (site.captured(batch.logger())) {
+    log_kv_impl(site, batch.logger(), args...);
+    return;
+  }
+  batch.add(
+      site,
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out) {
+        append_kv_message(buffer, out, args...);
+      },
+      [&](ThreadLocalBuffer &buffer, LineBuffer &out, OutputFormat format) {
+        append_kv_fields(buffer, out, format, args...);
+      });
+}
+
+[[noreturn]] inline void flush_and_abort() {
+  flush();
+  std::abort();
+}
+} // namespace detail
+
+namespace detail {
+// Settings read from the environment or a config file. Those left unset keep
+// their current values.
+struct ConfigValues {
+  std::optional<Level> level;
+  std::optional<bool> include_location;
+  std::optional<bool> include_thread_id;
+  std::optional<ThreadIdFormat> thread_id_format;
+  std::optional<bool> use_colours;
+  std::optional<OutputFormat> output_format;
+  std::optional<TimestampPrecision> timestamp_precision;
+  std::optional<std::string> pattern;
+  std::vector<std::pair<std::string, Level>> logger_levels;
+  std::vector<std::pair<std::string, Level>> file_levels;
+};
+
+// Case-insensitive match against a lower-case ASCII name
+inline bool equals_lower(std::string_view text, std::string_view lower) {
+  auto same = [](char c, char expected) {
+    return (c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c) ==
+           expected;
+  };
+  return text.size() == lower.size() &&
+         std::equal(text.begin(), text.end(), lower.begin(), same);
+}
+
+inline std::string_view trim_spaces(std::string_view text) {
+  auto space = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+  while (!text.empty() && space(text.front())) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && space(text.back())) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+inline std::optional<Level> parse_level(std::string_view text) {
+  static constexpr std::string_view kNames[] = {"trace", "debug", "info",
+                                                "warn",  "error", "fatal"};
+  for (std::size_t i = 0; i < kLevelCount; ++i) {
+    if (equals_lower(text, kNames[i])) {
+      return static_cast<Level>(i);
+    }
+  }
+  if (equals_lower(text, "warning")) {
+    return Level::WARN;
+  }
+  return std::nullopt;
+}
+
+inline std::optional<bool> parse_bool(std::string_view text) {
+  for (auto yes : {"1", "true", "yes", "on"}) {
+    if (equals_lower(text, yes)) {
+      return true;
+    }
+  }
+  for (auto no : {"0", "false", "no", "off"}) {
+    if (equals_lower(text, no)) {
+      return false;
+    }
+  }
+  return std::nullopt;
+}
+
+// Sets the setting `key` from `value`; false for an unknown key or a value
+// it does not take
+inline bool set_config_value(ConfigValues &values, std::string_view key,
+                             std::string_view value) {
+  auto choose = [&](auto &field, auto... options) {
+    for (const auto &[name, option] : {options...}) {
+      if (equals_lower(value, name)) {
+        field = option;
+        return true;
+      }
+    }
+    return false;
+  };
+  auto named_level = [&](auto &levels, std::string_view prefix) {
+    auto level = parse_level(value);
+    if (key.size() == prefix.size() || !level) {
+      return false;
+    }
+    levels.emplace_back(std::string(key.substr(prefix.size())), *level);
+    return true;
+  };
+  if (key == "level") {
+    values.level = parse_level(value);
+    return values.level.has_value();
+  }
+  if (key == "include_location") {
+    values.include_location = parse_bool(value);
+    return values.include_location.has_value();
+  }
+  if (key == "include_thread_id") {
+    values.include_thread_id = parse_bool(value);
+    return values.include_thread_id.has_value();
+  }
+  if (key == "colours") {
+    values.use_colours = parse_bool(value);
+    return values.use_colours.has_value();
+  }
+  if (key == "thread_id_format") {
+    using Option = std::pair<std::string_view, ThreadIdFormat>;
+    return choose(values.thread_id_format,
+                  Option{"native", ThreadIdFormat::Native},
+                  Option{"index", ThreadIdFormat::Index},
+                  Option{"tid", ThreadIdFormat::OsTid});
+  }
+  if (key == "format") {
+    using Option = std::pair<std::string_view, OutputFormat>;
+    return choose(values.output_format, Option{"text", OutputFormat::Text},
+                  Option{"json", OutputFormat::Json},
+                  Option{"logfmt", OutputFormat::Logfmt});
+  }
+  if (key == "precision") {
+    using Option = std::pair<std::string_view, TimestampPrecision>;
+    return choose(values.timestamp_precision,
+                  Option{"ms", TimestampPrecision::Milliseconds},
+                  Option{"us", TimestampPrecision::Microseconds},
+                  Option{"ns", TimestampPrecision::Nanoseconds});
+  }
+  if (key == "pattern") {
+    values.pattern = std::string(value);
+    return true;
+  }
+  if (key.substr(0, 7) == "logger.") {
+    return named_level(values.logger_levels, "logger.");
+  }
+  if (key.substr(0, 5) == "file.") {
+    return named_level(values.file_levels, "file.");
+  }
+  return false;
+}
+
+// `key = value` lines; blank lines and those starting with '#' are skipped.
+// `source` names the text in errors.
+inline ConfigValues parse_config(std::string_view text,
+                                 std::string_view source) {
+  ConfigValues values;
+  int number = 0;
+  while (!text.empty()) {
+    auto end = std::min(text.find('\n'), text.size());
+    auto line = trim_spaces(text.substr(0, end));
+    text.remove_prefix(std::min(end + 1, text.size()));
+    ++number;
+    if (line.empty() || line.front() == '#') {
+      continue;
+    }
+    auto equals = line.find('=');
+    if (equals == std::string_view::npos ||
+        !set_config_value(values, trim_spaces(line.substr(0, equals)),
+                          trim_spaces(line.substr(equals + 1)))) {
+      throw std::invalid_argument("logging: " + std::string(source) + ":" +
+                                  std::to_string(number) + ": bad setting '" +
+                                  std::string(line) + "'");
+    }
+  }
+  return values;
+}
+
+inline ConfigValues read_config(const std::string &path) {
+  std::FILE *file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    throw std::runtime_error("logging: cannot open " + path);
+  }
+  std::string text;
+  char chunk[4096];
+  std::size_t n;
+  while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    text.append(chunk, n);
+  }
+  bool failed = std::ferror(file) != 0;
+  std::fclose(file);
+  if (failed) {
+    throw std::runtime_error("logging: cannot read " + path);
+  }
+  return parse_config(text, path);
+}
+
+// LOG_<KEY> for each config key, plus LOG_LEVELS ("net=debug,db=warn") for
+// named loggers and LOG_FILE_LEVELS ("net/socket.cpp=trace") for files
+inline ConfigValues read_env() {
+  ConfigValues values;
+  auto bad = [](const char *name, std::string_view value) {
+    return std::invalid_argument("logging: " + std::string(name) +
+                                 ": bad value '" + std::string(value) + "'");
+  };
+  static constexpr std::pair<const char *, std::string_view> kKeys[] = {
+      {"LOG_LEVEL", "level"},
+      {"LOG_INCLUDE_LOCATION", "include_location"},
+      {"LOG_INCLUDE_THREAD_ID", "include_thread_id"},
+      {"LOG_THREAD_ID_FORMAT", "thread_id_format"},
+      {"LOG_COLOURS", "colours"},
+      {"LOG_FORMAT", "format"},
+      {"LOG_PRECISION", "precision"},
+      {"LOG_PATTERN", "pattern"}};
+  for (const auto &[name, key] : kKeys) {
+    if (const char *value = std::getenv(name)) {
+      if (!set_config_value(values, key, trim_spaces(value))) {
+        throw bad(name, value);
+      }
+    }
+  }
+  static constexpr std::pair<const char *, std::string_view> kLists[] = {
+      {"LOG_LEVELS", "logger."}, {"LOG_FILE_LEVELS", "file."}};
+  for (const auto &[name, prefix] : kLists) {
+    const char *value = std::getenv(name);
+    std::string_view list = value ? value : "";
+    while (!list.empty()) {
+      auto end = std::min(list.find(','), list.size());
+      auto item = trim_spaces(list.substr(0, end));
+      list.remove_prefix(std::min(end + 1, list.size()));
+      if (item.empty()) {
+        continue;
+      }
+      auto equals = item.find('=');
+      if (equals == std::string_view::npos) {
+        throw bad(name, item);
+      }
+      auto key = std::string(prefix);
+      key += trim_spaces(item.substr(0, equals));
+      if (!set_config_value(values, key,
+                            trim_spaces(item.substr(equals + 1)))) {
+        throw bad(name, item);
+      }
+    }
+  }
+  return values;
+}
+
+// Applies loaded settings: one new Config snapshot, then only the call
+// sites whose level changed are recomputed
+class ConfigLoader {
+public:
+  static ConfigLoader &instance() {
+    static ConfigLoader instance;
+    return instance;
+  }
+
+  // The logger and file levels of a config file replace those it set the
+  // last time, so entries removed from the file are undone
+  void apply(const ConfigValues &values, bool from_file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (values.pattern) {
+      Layouts::instance().set(*values.pattern); // Throws if invalid
+    }
+    SiteRegistry::LevelChanges changes;
+    State::instance().update([&](Config &config) {
+      if (values.level) {
+        changes.global = config.current_level != *values.level;
+        config.current_level = *values.level;
+      }
+      config.include_location =
+          values.include_location.value_or(config.include_location);
+      config.include_thread_id =
+          values.include_thread_id.value_or(config.include_thread_id);
+      config.thread_id_format =
+          values.thread_id_format.value_or(config.thread_id_format);
+      config.use_colours = values.use_colours.value_or(config.use_colours);
+      config.output_format =
+          values.output_format.value_or(config.output_format);
+      config.timestamp_precision =
+          values.timestamp_precision.value_or(config.timestamp_precision);
+    });
+
+    auto &loggers = LoggerRegistry::instance();
+    auto set_logger = [&](const std::string &name, Level level) {
+      auto &logger = loggers.get(name);
+      if (LoggerRegistry::set_level(logger, level)) {
+        changes.loggers.push_back(&logger);
+      }
+    };
+    auto listed = [](const auto &levels, const std::string &name) {
+      return std::any_of(
+          levels.begin(), levels.end(),
+          [&](const auto &entry) { return entry.first == name; });
+    };
+    for (const auto &[name, level] : values.logger_levels) {
+      set_logger(name, level);
+    }
+    for (const auto &[file, level] : values.file_levels) {
+      changes.files.emplace_back(file, level);
+    }
+    if (from_file) {
+      // Loggers the file no longer names go back to the global level
+      auto global = State::instance().level();
+      for (const auto &name : file_loggers_) {
+        if (!listed(values.logger_levels, name)) {
+          set_logger(name, global);
+        }
+      }
+      for (const auto &file : file_files_) {
+        if (!listed(values.file_levels, file)) {
+          changes.files.emplace_back(file, std::nullopt);
+        }
+      }
+      file_loggers_.clear();
+      for (const auto &entry : values.logger_levels) {
+        file_loggers_.push_back(entry.first);
+      }
+      file_files_.clear();
+      for (const auto &entry : values.file_levels) {
+        file_files_.push_back(entry.first);
+      }
+    }
+    SiteRegistry::instance().apply(changes);
+  }
+
+private:
+  ConfigLoader() {
+    State::instance();
+    Layouts::instance();
+    LoggerRegistry::instance();
+    SiteRegistry::instance();
+  }
+
+  std::mutex mutex_;
+  // Set by the last config file
+  std::vector<std::string> file_loggers_;
+  std::vector<std::string> file_files_;
+};
+
+// Writes a record of the logger's own, e.g. a failed reload, straight to the
+// sinks
+inline void write_notice(Level level, std::string_view message) {
+  static const char site = 0;
+  const auto &thread = ThreadInfo::instance().tag(
+      State::Hold()->thread_id_format);
+  auto time = std::chrono::system_clock::now();
+  auto &line = ThreadLocalBuffer::instance().line();
+  auto span = format_line(line, level, time, thread.view(), __FILE__, __LINE__,
+                          [&] { line.append(message); });
+  std::string_view text = line.view();
+  RecordView view{level,
+                  time,
+                  thread.view(),
+                  __FILE__,
+                  __LINE__,
+                  text.substr(span.begin, span.end - span.begin),
+                  text,
+                  &site,
+                  {},
+                  {},
+                  nullptr};
+  std::lock_guard<std::mutex> lock(output_mutex());
+  write_to_sinks(&view, 1);
+}
+} // namespace detail
+
+// Applies a config file of `key = value` lines ('#' starts a comment):
+//
+//   level = info                  # trace, debug, info, warn, error, fatal
+//   include_location = true
+//   include_thread_id = false
+//   thread_id_format = index      # native, index, tid
+//   colours = false
+//   format = json                 # text, json, logfmt
+//   precision = us                # ms, us, ns
+//   pattern = %t %l %m
+//   logger.net = debug            # Level of logging::get("net")
+//   file.net/socket.cpp = trace   # As set_file_level()
+//
+// Settings the file leaves out keep their values. The logger and file levels
+// replace those set by the previous file. Throws std::runtime_error if the
+// file cannot be read, or std::invalid_argument naming the first bad line;
+// nothing is applied then.
+inline void load_config(const std::string &path) {
+  detail::ConfigLoader::instance().apply(detail::read_config(path), true);
+}
+
+// Applies the LOG_LEVEL, LOG_INCLUDE_LOCATION, LOG_INCLUDE_THREAD_ID,
+// LOG_THREAD_ID_FORMAT, LOG_COLOURS, LOG_FORMAT, LOG_PRECISION and
+// LOG_PATTERN environment variables, which take the config file's values,
+// plus LOG_LEVELS="net=debug,db=warn" for named loggers and
+// LOG_FILE_LEVELS="net/socket.cpp=trace" for files. A file named by
+// LOG_CONFIG is loaded first. Throws std::invalid_argument for a bad value.
+inline void load_env() {
+  auto values = detail::read_env();
+  if (const char *path = std::getenv("LOG_CONFIG")) {
+    load_config(path);
+  }
+  detail::ConfigLoader::instance().apply(values, false);
+}
+
+#if LOGGING_POSIX
+// What makes watch_config() reload the file
+struct WatchOptions {
+  // Also reload on SIGHUP, whose previous disposition is restored by
+  // stop_watching_config()
+  bool sighup = false;
+  // How often the file's size, modification time and inode are checked.
+  // On Linux, inotify reports changes sooner.
+  std::chrono::milliseconds poll_interval{1000};
+};
+
+namespace detail {
+// Background thread reloading a config file when it changes. A file that
+// fails to load is reported once with a WARN record and the settings in
+// force are kept.
+class ConfigWatcher {
+public:
+  static ConfigWatcher &instance() {
+    static ConfigWatcher instance;
+    return instance;
+  }
+
+  ~ConfigWatcher() { stop(); }
+
+  void start(const std::string &path, const WatchOptions &options) {
+    stop();
+    std::lock_guard<std::mutex> lock(mutex_);
+    int fds[2];
+    if (::pipe(fds) != 0) {
+      throw std::runtime_error("logging: cannot create the watcher pipe");
+    }
+    for (int fd : fds) {
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    wake_read_ = fds[0];
+    wake_write_ = fds[1];
+    path_ = path;
+    options_ = options;
+    signature_ = signature();
+#if defined(__linux__)
+    // Watch the directory, so editors that replace the file are seen
+    inotify_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_ >= 0) {
+      auto slash = path.find_last_of('/');
+      std::string dir = slash == std::string::npos ? "."
+                        : slash == 0               ? "/"
+                                                   : path.substr(0, slash);
+      ::inotify_add_watch(inotify_, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                              IN_ATTRIB);
+    }
+#endif
+    if (options.sighup) {
+      signal_fd_.store(wake_write_, std::memory_order_release);
+      struct sigaction action {};
+      action.sa_handler = &ConfigWatcher::handle;
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      ::sigaction(SIGHUP, &action, &previous_);
+    }
+    worker_ = std::thread([this] { run(); });
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!worker_.joinable()) {
+      return;
+    }
+    if (options_.sighup) {
+      ::sigaction(SIGHUP, &previous_, nullptr);
+      signal_fd_.store(-1, std::memory_order_release);
+    }
+    char quit = 'q';
+    while (::write(wake_write_, &quit, 1) < 0 && errno == EINTR) {
+    }
+    worker_.join();
+    for (int *fd : {&wake_read_, &wake_write_, &inotify_}) {
+      if (*fd >= 0) {
+        ::close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+private:
+  struct Signature {
+    ino_t inode = 0;
+    off_t size = -1;
+    std::int64_t modified_ns = 0;
+
+    bool operator==(const Signature &other) const {
+      return inode == other.inode && size == other.size &&
+             modified_ns == other.modified_ns;
+    }
+  };
+
+  ConfigWatcher() {
+    // Construct what run() uses first, so it is destroyed after us
+    ConfigLoader::instance();
+    Deduplicator::instance();
+    output_mutex();
+    default_sink();
+  }
+
+  static void handle(int) {
+    int saved = errno;
+    int fd = signal_fd_.load(std::memory_order_acquire);
+    if (fd >= 0) {
+      char hangup = 'h';
+      [[maybe_unused]] auto written = ::write(fd, &hangup, 1);
+    }
+    errno = saved;
+  }
+
+  // Unset if the file is missing, e.g. between an editor's unlink and rename
+  std::optional<Signature> signature() const {
+    struct stat info {};
+    if (::stat(path_.c_str(), &info) != 0) {
+      return std::nullopt;
+    }
+    Signature result;
+    result.inode = info.st_ino;
+    result.size = info.st_size;
+#if defined(__APPLE__)
+    result.modified_ns = info.st_mtimespec.tv_sec * 1000000000LL +
+                         info.st_mtimespec.tv_nsec;
+#else
+    result.modified_ns =
+        info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+    return result;
+  }
+
+  void run() {
+    while (true) {
+      pollfd fds[2] = {{wake_read_, POLLIN, 0}, {inotify_, POLLIN, 0}};
+      int timeout = static_cast<int>(std::max<std::int64_t>(
+          options_.poll_interval.count(), 1));
+      if (::poll(fds, inotify_ >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+        return;
+      }
+      bool force = false;
+      if (fds[0].revents & POLLIN) {
+        char bytes[64];
+        ssize_t n;
+        while ((n = ::read(wake_read_, bytes, sizeof(bytes))) > 0) {
+          if (std::memchr(bytes, 'q', static_cast<std::size_t>(n))) {
+            return;
+          }
+          force = true;
+        }
+      }
+      if (inotify_ >= 0 && (fds[1].revents & POLLIN)) {
+        // Only a wake-up; the signature says whether this file changed
+        alignas(8) char events[4096];
+        while (::read(inotify_, events, sizeof(events)) > 0) {
+        }
+      }
+      auto current = signature();
+      if (!current || (!force && signature_ && *current == *signature_)) {
+        continue;
+      }
+      signature_ = current;
+      try {
+        ConfigLoader::instance().apply(read_config(path_), true);
+      } catch (const std::exception &error) {
+        write_notice(Level::WARN,
+                     std::string(error.what()) + "; keeping the settings");
+      }
+    }
+  }
+
+  // Written by the SIGHUP handler's write end; -1 when not installed
+  static inline std::atomic<int> signal_fd_{-1};
+
+  std::mutex mutex_;
+  std::thread worker_;
+  std::string path_;
+  WatchOptions options_;
+  std::optional<Signature> signature_;
+  int wake_read_ = -1;
+  int wake_write_ = -1;
+  int inotify_ = -1;
+  struct sigaction previous_ {};
+};
+} // namespace detail
+
+// Loads `path`, then reloads it on a separate thread whenever it changes,
+// as load_config() would. Each reload publishes one new settings snapshot
+// and recomputes only the call sites whose level changed; log calls do no
+// extra work. Throws as load_config() if the first load fails.
+inline void watch_config(const std::string &path,
+                         const WatchOptions &options = {}) {
+  load_config(path);
+  detail::ConfigWatcher::instance().start(path, options);
+}
+
+inline void stop_watching_config() { detail::ConfigWatcher::instance().stop(); }
+#endif
+
+// Conditional logging macros that avoid argument evaluation when disabled
+
+// Each expansion owns a static CallSite. Calls below LOGGING_ACTIVE_LEVEL
+// compile to nothing.
+#define LOGGING_LOG(level, ...)                                                \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      if (logging_site.enabled()) {                                            \
+        ::logging::detail::log_impl(logging_site, nullptr, __VA_ARGS__);       \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_TRACE(...) LOGGING_LOG(::logging::Level::TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOGGING_LOG(::logging::Level::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOGGING_LOG(::logging::Level::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOGGING_LOG(::logging::Level::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOGGING_LOG(::logging::Level::ERROR, __VA_ARGS__)
+#define LOG_FATAL(...) LOGGING_LOG(::logging::Level::FATAL, __VA_ARGS__)
+
+// Structured macros: LOG_INFO_KV("request done", logging::kv("user", id)).
+// Fields are written as key=value, or as members in the Json format.
+#define LOGGING_LOG_KV(level, ...)                                             \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      if (logging_site.enabled()) {                                            \
+        ::logging::detail::log_kv_impl(logging_site, nullptr, __VA_ARGS__);    \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_TRACE_KV(...) LOGGING_LOG_KV(::logging::Level::TRACE, __VA_ARGS__)
+#define LOG_DEBUG_KV(...) LOGGING_LOG_KV(::logging::Level::DEBUG, __VA_ARGS__)
+#define LOG_INFO_KV(...) LOGGING_LOG_KV(::logging::Level::INFO, __VA_ARGS__)
+#define LOG_WARN_KV(...) LOGGING_LOG_KV(::logging::Level::WARN, __VA_ARGS__)
+#define LOG_ERROR_KV(...) LOGGING_LOG_KV(::logging::Level::ERROR, __VA_ARGS__)
+#define LOG_FATAL_KV(...) LOGGING_LOG_KV(::logging::Level::FATAL, __VA_ARGS__)
+
+// Rate-limited macros: LOG_INFO_EVERY_N(100, ...) logs the first of every
+// 100 calls, LOG_WARN_EVERY_MS(1000, ...) at most once a second and
+// LOG_DEBUG_SAMPLED(0.01, ...) about 1% of calls. Suppressed calls do not
+// evaluate their arguments.
+#define LOGGING_LOG_LIMITED(level, limiter, limit, ...)                        \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      static ::logging::detail::limiter logging_limiter;                       \
+      if (logging_site.enabled() && logging_limiter.allow(limit)) {            \
+        ::logging::detail::log_impl(logging_site, nullptr, __VA_ARGS__);       \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_TRACE_EVERY_N(n, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::TRACE, EveryN, n, __VA_ARGS__)
+#define LOG_DEBUG_EVERY_N(n, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::DEBUG, EveryN, n, __VA_ARGS__)
+#define LOG_INFO_EVERY_N(n, ...)                                               \
+  LOGGING_LOG_LIMITED(::logging::Level::INFO, EveryN, n, __VA_ARGS__)
+#define LOG_WARN_EVERY_N(n, ...)                                               \
+  LOGGING_LOG_LIMITED(::logging::Level::WARN, EveryN, n, __VA_ARGS__)
+#define LOG_ERROR_EVERY_N(n, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::ERROR, EveryN, n, __VA_ARGS__)
+#define LOG_FATAL_EVERY_N(n, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::FATAL, EveryN, n, __VA_ARGS__)
+
+#define LOG_TRACE_EVERY_MS(ms, ...)                                            \
+  LOGGING_LOG_LIMITED(::logging::Level::TRACE, EveryMs, ms, __VA_ARGS__)
+#define LOG_DEBUG_EVERY_MS(ms, ...)                                            \
+  LOGGING_LOG_LIMITED(::logging::Level::DEBUG, EveryMs, ms, __VA_ARGS__)
+#define LOG_INFO_EVERY_MS(ms, ...)                                             \
+  LOGGING_LOG_LIMITED(::logging::Level::INFO, EveryMs, ms, __VA_ARGS__)
+#define LOG_WARN_EVERY_MS(ms, ...)                                             \
+  LOGGING_LOG_LIMITED(::logging::Level::WARN, EveryMs, ms, __VA_ARGS__)
+#define LOG_ERROR_EVERY_MS(ms, ...)                                            \
+  LOGGING_LOG_LIMITED(::logging::Level::ERROR, EveryMs, ms, __VA_ARGS__)
+#define LOG_FATAL_EVERY_MS(ms, ...)                                            \
+  LOGGING_LOG_LIMITED(::logging::Level::FATAL, EveryMs, ms, __VA_ARGS__)
+
+#define LOG_TRACE_SAMPLED(p, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::TRACE, Sampler, p, __VA_ARGS__)
+#define LOG_DEBUG_SAMPLED(p, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::DEBUG, Sampler, p, __VA_ARGS__)
+#define LOG_INFO_SAMPLED(p, ...)                                               \
+  LOGGING_LOG_LIMITED(::logging::Level::INFO, Sampler, p, __VA_ARGS__)
+#define LOG_WARN_SAMPLED(p, ...)                                               \
+  LOGGING_LOG_LIMITED(::logging::Level::WARN, Sampler, p, __VA_ARGS__)
+#define LOG_ERROR_SAMPLED(p, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::ERROR, Sampler, p, __VA_ARGS__)
+#define LOG_FATAL_SAMPLED(p, ...)                                              \
+  LOGGING_LOG_LIMITED(::logging::Level::FATAL, Sampler, p, __VA_ARGS__)
+
+// Format-string macros: LOG_INFOF("user {} took {}ms", user, ms). The pattern
+// must be a string literal; it is parsed and checked against the argument
+// count at compile time.
+
+#define LOGGING_FIRST_ARG_(first, ...) first
+#define LOGGING_FIRST_ARG(...) LOGGING_FIRST_ARG_(__VA_ARGS__, 0)
+
+#define LOGGING_LOGF(level, ...)                                               \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      if (logging_site.enabled()) {                                            \
+        struct LoggingPattern {                                                \
+          static constexpr std::string_view value() {                          \
+            return LOGGING_FIRST_ARG(__VA_ARGS__);                             \
+          }                                                                    \
+        };                                                                     \
+        ::logging::detail::logf_impl<LoggingPattern>(logging_site, nullptr,    \
+                                                     __VA_ARGS__);             \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_TRACEF(...) LOGGING_LOGF(::logging::Level::TRACE, __VA_ARGS__)
+#define LOG_DEBUGF(...) LOGGING_LOGF(::logging::Level::DEBUG, __VA_ARGS__)
+#define LOG_INFOF(...) LOGGING_LOGF(::logging::Level::INFO, __VA_ARGS__)
+#define LOG_WARNF(...) LOGGING_LOGF(::logging::Level::WARN, __VA_ARGS__)
+#define LOG_ERRORF(...) LOGGING_LOGF(::logging::Level::ERROR, __VA_ARGS__)
+#define LOG_FATALF(...) LOGGING_LOGF(::logging::Level::FATAL, __VA_ARGS__)
+
+// Named-logger macros, taking a logging::Logger& first:
+//   static auto &net = logging::get("net");
+//   LOGGER_INFO(net, "connected to ", host);
+#define LOGGING_LOGGER_LOG(impl, logger, level, ...)                           \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      ::logging::Logger &logging_logger = (logger);                            \
+      if (logging_site.enabled(logging_logger)) {                              \
+        ::logging::detail::impl(logging_site, &logging_logger, __VA_ARGS__);   \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOGGING_LOGGER_LOGF(logger, level, ...)                                \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      ::logging::Logger &logging_logger = (logger);                            \
+      if (logging_site.enabled(logging_logger)) {                              \
+        struct LoggingPattern {                                                \
+          static constexpr std::string_view value() {                          \
+            return LOGGING_FIRST_ARG(__VA_ARGS__);                             \
+          }                                                                    \
+        };                                                                     \
+        ::logging::detail::logf_impl<LoggingPattern>(                          \
+            logging_site, &logging_logger, __VA_ARGS__);                       \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOGGER_TRACE(logger, ...)                                              \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::TRACE, __VA_ARGS__)
+#define LOGGER_DEBUG(logger, ...)                                              \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::DEBUG, __VA_ARGS__)
+#define LOGGER_INFO(logger, ...)                                               \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::INFO, __VA_ARGS__)
+#define LOGGER_WARN(logger, ...)                                               \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::WARN, __VA_ARGS__)
+#define LOGGER_ERROR(logger, ...)                                              \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::ERROR, __VA_ARGS__)
+#define LOGGER_FATAL(logger, ...)                                              \
+  LOGGING_LOGGER_LOG(log_impl, logger, ::logging::Level::FATAL, __VA_ARGS__)
+
+#define LOGGER_TRACE_KV(logger, ...)                                           \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::TRACE, __VA_ARGS__)
+#define LOGGER_DEBUG_KV(logger, ...)                                           \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::DEBUG, __VA_ARGS__)
+#define LOGGER_INFO_KV(logger, ...)                                            \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::INFO, __VA_ARGS__)
+#define LOGGER_WARN_KV(logger, ...)                                            \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::WARN, __VA_ARGS__)
+#define LOGGER_ERROR_KV(logger, ...)                                           \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::ERROR, __VA_ARGS__)
+#define LOGGER_FATAL_KV(logger, ...)                                           \
+  LOGGING_LOGGER_LOG(log_kv_impl, logger, ::logging::Level::FATAL, __VA_ARGS__)
+
+#define LOGGER_TRACEF(logger, ...)                                             \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::TRACE, __VA_ARGS__)
+#define LOGGER_DEBUGF(logger, ...)                                             \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::DEBUG, __VA_ARGS__)
+#define LOGGER_INFOF(logger, ...)                                              \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::INFO, __VA_ARGS__)
+#define LOGGER_WARNF(logger, ...)                                              \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::WARN, __VA_ARGS__)
+#define LOGGER_ERRORF(logger, ...)                                             \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::ERROR, __VA_ARGS__)
+#define LOGGER_FATALF(logger, ...)                                             \
+  LOGGING_LOGGER_LOGF(logger, ::logging::Level::FATAL, __VA_ARGS__)
+
+// Batch macros, taking a logging::Batch& first. Each line is filtered like
+// the matching LOG_* call.
+#define LOGGING_BATCH_LOG(impl, batch, level, ...)                             \
+  do {                                                                         \
+    if constexpr (::logging::detail::is_compiled_in(level)) {                  \
+      static ::logging::detail::CallSite logging_site{__FILE__, __LINE__,      \
+                                                      level};                  \
+      ::logging::Batch &logging_batch = (batch);                               \
+      if (logging_batch.enabled(logging_site)) {                               \
+        ::logging::detail::impl(logging_batch, logging_site, __VA_ARGS__);     \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define BATCH_TRACE(batch, ...)                                               \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::TRACE, __VA_ARGS__)
+#define BATCH_DEBUG(batch, ...)                                               \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::DEBUG, __VA_ARGS__)
+#define BATCH_INFO(batch, ...)                                                \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::INFO, __VA_ARGS__)
+#define BATCH_WARN(batch, ...)                                                \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::WARN, __VA_ARGS__)
+#define BATCH_ERROR(batch, ...)                                               \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::ERROR, __VA_ARGS__)
+#define BATCH_FATAL(batch, ...)                                               \
+  LOGGING_BATCH_LOG(batch_impl, batch, ::logging::Level::FATAL, __VA_ARGS__)
+
+#define BATCH_TRACE_KV(batch, ...)                                            \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::TRACE, __VA_ARGS__)
+#define BATCH_DEBUG_KV(batch, ...)                                            \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::DEBUG, __VA_ARGS__)
+#define BATCH_INFO_KV(batch, ...)                                             \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::INFO, __VA_ARGS__)
+#define BATCH_WARN_KV(batch, ...)                                             \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::WARN, __VA_ARGS__)
+#define BATCH_ERROR_KV(batch, ...)                                            \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::ERROR, __VA_ARGS__)
+#define BATCH_FATAL_KV(batch, ...)                                            \
+  LOGGING_BATCH_LOG(batch_kv_impl, batch, ::logging::Level::FATAL, __VA_ARGS__)
+
+// Logs at FATAL, waits until everything logged so far is written and aborts
+#define LOG_FATAL_ABORT(...)                                                   \
+  do {                                                                         \
+    LOG_FATAL(__VA_ARGS__);                                                    \
+    ::logging::detail::flush_and_abort();                                      \
   } while (0)
 
 // Convenience macros for conditional compilation